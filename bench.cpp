@@ -0,0 +1,215 @@
+#include "memory_pool.h"
+#include "pool_locks.h"
+#include "flat_combining_pool.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <thread>
+#include <vector>
+
+/* Throughput benchmarks for memory_pool. Every thread allocates a batch of
+ * objects and frees them again, over and over, so the numbers are dominated
+ * by the pool's critical sections and the lock around them. */
+
+class object
+{
+private:
+	unsigned long a;
+	unsigned long b;
+	unsigned long c;
+};
+
+static constexpr size_t batch_size = 64;
+static constexpr size_t default_ops = 1 << 20;
+
+template <typename Pool>
+static void churn(Pool &pool, size_t ops)
+{
+	object *batch[batch_size];
+
+	for(size_t done = 0; done < ops; done += batch_size)
+	{
+		for(auto &p : batch)
+			p = pool.allocate();
+		for(auto p : batch)
+			pool.free(p);
+	}
+}
+
+/* Returns allocate+free pairs per second over all threads */
+template <typename Pool>
+static double run_threads(Pool &pool, unsigned int nr_threads, size_t ops_per_thread)
+{
+	std::vector<std::thread> threads;
+	auto start = std::chrono::steady_clock::now();
+
+	for(unsigned int i = 0; i < nr_threads; i++)
+		threads.emplace_back([&]() { churn(pool, ops_per_thread); });
+	for(auto &t : threads)
+		t.join();
+
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+	return nr_threads * ops_per_thread / elapsed.count();
+}
+
+template <typename Pool>
+static void bench_pool(const char *name, const std::vector<unsigned int> &thread_counts, size_t ops)
+{
+	std::printf("%-16s", name);
+
+	for(auto nr_threads : thread_counts)
+	{
+		Pool pool;
+		std::printf(" %12.2f", run_threads(pool, nr_threads, ops / nr_threads) / 1e6);
+	}
+
+	std::printf("\n");
+}
+
+template <typename Lock>
+using locked_pool = memory_pool<object, default_object_alignment<object>(), Lock>;
+
+static void print_header(const char *title, const std::vector<unsigned int> &thread_counts, size_t ops)
+{
+	std::printf("%s, million allocate+free pairs per second (%zu pairs total)\n", title, ops);
+	std::printf("%-16s", "threads");
+	for(auto n : thread_counts)
+		std::printf(" %12u", n);
+	std::printf("\n");
+}
+
+static void bench_locks(const std::vector<unsigned int> &thread_counts, size_t ops)
+{
+	print_header("Lock policies", thread_counts, ops);
+	bench_pool<locked_pool<std::mutex>>("std::mutex", thread_counts, ops);
+	bench_pool<locked_pool<ttas_lock>>("ttas", thread_counts, ops);
+	bench_pool<locked_pool<ticket_lock>>("ticket", thread_counts, ops);
+	bench_pool<locked_pool<mcs_lock>>("mcs", thread_counts, ops);
+	bench_pool<locked_pool<adaptive_futex_lock>>("spin-futex", thread_counts, ops);
+}
+
+/* Where flat combining starts to pay off against plain locking */
+static void bench_combining(const std::vector<unsigned int> &thread_counts, size_t ops)
+{
+	print_header("Flat combining crossover", thread_counts, ops);
+	bench_pool<locked_pool<std::mutex>>("std::mutex", thread_counts, ops);
+	bench_pool<locked_pool<adaptive_futex_lock>>("spin-futex", thread_counts, ops);
+	bench_pool<flat_combining_pool<object>>("flat-combining", thread_counts, ops);
+}
+
+/* A pool that samples one in Rate allocations for hardening checks */
+template <size_t Rate>
+class sampled_pool : public memory_pool<object>
+{
+private:
+	static memory_pool_tunables tunables()
+	{
+		memory_pool_tunables t;
+		t.sample_rate = Rate;
+		return t;
+	}
+public:
+	sampled_pool() : memory_pool<object>{tunables()} {}
+};
+
+/* What sampled hardening costs on the allocate/free paths */
+static void bench_hardening(const std::vector<unsigned int> &thread_counts, size_t ops)
+{
+	print_header("Sampled hardening", thread_counts, ops);
+	bench_pool<sampled_pool<0>>("off", thread_counts, ops);
+	bench_pool<sampled_pool<10000>>("1 in 10000", thread_counts, ops);
+	bench_pool<sampled_pool<1000>>("1 in 1000", thread_counts, ops);
+	bench_pool<sampled_pool<100>>("1 in 100", thread_counts, ops);
+}
+
+template <size_t Size>
+struct sized_object
+{
+	unsigned char data[Size];
+};
+
+static constexpr size_t layout_working_set = 64 * 1024 * 1024;
+
+/* Density against how many pages and cache lines a random object write
+ * touches. Objects are written in random order, so every write is a cache
+ * miss and most are TLB misses as well. */
+template <size_t Size>
+static void bench_layout(const char *name, chunk_layout layout)
+{
+	using T = sized_object<Size>;
+	memory_pool_tunables tunables;
+	tunables.layout = layout;
+	tunables.segment_size = 256 * 1024;
+	tunables.stats = true;
+	memory_pool<T> pool{tunables};
+
+	std::vector<T *> objs(layout_working_set / Size);
+	size_t page_crossings = 0, line_crossings = 0;
+	for(auto &o : objs)
+	{
+		o = pool.allocate();
+		auto first = reinterpret_cast<uintptr_t>(o) - sizeof(memory_chunk<T>);
+		auto last = reinterpret_cast<uintptr_t>(o + 1) - 1;
+		page_crossings += first / PAGE_SIZE != last / PAGE_SIZE;
+		line_crossings += first / cache_line_size != last / cache_line_size;
+	}
+
+	std::shuffle(objs.begin(), objs.end(), std::mt19937{42});
+
+	auto start = std::chrono::steady_clock::now();
+	for(int pass = 0; pass < 4; pass++)
+	{
+		for(auto o : objs)
+			std::memset(o, pass, Size);
+	}
+	std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+
+	auto mapped = pool.stats().segments_mapped * pool.get_tunables().segment_size;
+	std::printf("%-16s %12zu %12.1f %12.1f %12.2f\n", name, objs.size() * (1024 * 1024) / mapped,
+		    100.0 * page_crossings / objs.size(), 100.0 * line_crossings / objs.size(),
+		    elapsed.count() / (4 * objs.size()));
+
+	for(auto o : objs)
+		pool.free(o);
+}
+
+template <size_t Size>
+static void bench_layouts()
+{
+	std::printf("%zu-byte objects\n", Size);
+	bench_layout<Size>("dense", chunk_layout::dense);
+	bench_layout<Size>("page", chunk_layout::page);
+	bench_layout<Size>("cache-line", chunk_layout::cache_line);
+}
+
+static void bench_chunk_layouts()
+{
+	std::printf("Chunk layouts, random writes over %zu MiB of objects\n", layout_working_set >> 20);
+	std::printf("%-16s %12s %12s %12s %12s\n", "layout", "objs/MiB", "%page-cross", "%line-cross", "ns/write");
+	bench_layouts<32>();
+	bench_layouts<200>();
+	bench_layouts<1500>();
+}
+
+int main(int argc, char **argv)
+{
+	size_t ops = argc > 1 ? std::strtoul(argv[1], nullptr, 0) : default_ops;
+	std::vector<unsigned int> thread_counts;
+	auto max_threads = std::max(4U, 2 * std::thread::hardware_concurrency());
+
+	for(unsigned int n = 1; n <= max_threads; n *= 2)
+		thread_counts.push_back(n);
+
+	bench_locks(thread_counts, ops);
+	std::printf("\n");
+	bench_combining(thread_counts, ops);
+	std::printf("\n");
+	bench_hardening(thread_counts, ops);
+	std::printf("\n");
+	bench_chunk_layouts();
+
+	return 0;
+}
@@ -0,0 +1,273 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+#include "memory_pool.h"
+#include "pool_locks.h"
+
+/* Flat combining on top of memory_pool, for pools that many threads hammer at
+ * once. Instead of every thread dragging the lock and the free list cache
+ * lines over to itself, threads publish their allocate/free requests in
+ * per-thread slots. Whoever gets the combiner lock runs all the pending
+ * requests in one go while the free list stays hot in its cache, and the
+ * others just wait for their slot to be marked done.
+ *
+ * Each thread claims a slot the first time it uses a pool and keeps it until
+ * it exits. Once all slots are taken, further threads fall back to taking
+ * the combiner lock and doing their own operations. */
+template <typename T, size_t alignment = default_object_alignment<T>()>
+class flat_combining_pool : public reclaimable_pool, public page_owner
+{
+private:
+	static constexpr unsigned int nr_slots = 64;
+
+	enum slot_state : uint32_t
+	{
+		slot_idle = 0,
+		slot_allocate,
+		slot_free,
+		slot_done
+	};
+
+	struct alignas(64) slot
+	{
+		std::atomic<uint32_t> state;
+		/* The thread_slots of the thread the slot belongs to, or nullptr */
+		std::atomic<void *> owner;
+		T *ptr;
+	};
+
+	/* Gives back a thread's slots in every pool still around when it exits */
+	struct thread_slots
+	{
+		~thread_slots()
+		{
+			std::scoped_lock guard{live_lock};
+			for(auto p : live_pools)
+			{
+				for(auto &s : p->slots)
+				{
+					void *me = this;
+					if(s.owner.compare_exchange_strong(me, nullptr, std::memory_order_release))
+						p->nr_owned.fetch_sub(1, std::memory_order_relaxed);
+				}
+			}
+		}
+	};
+
+	/* Threads remember their slot per pool. Pools get a unique id so that a
+	 * new pool at a dead pool's address doesn't inherit its slots. */
+	struct slot_cache_entry
+	{
+		uint64_t pool_id;
+		slot *s;
+	};
+
+	static constexpr unsigned int slot_cache_size = 8;
+	static inline thread_local slot_cache_entry slot_cache[slot_cache_size];
+	static inline thread_local unsigned int slot_cache_next = 0;
+	static inline std::atomic<uint64_t> next_pool_id{1};
+	static inline thread_local thread_slots this_thread_slots;
+	/* Pools a thread_slots may still have slots in */
+	static inline std::mutex live_lock;
+	static inline std::vector<flat_combining_pool *> live_pools;
+
+	memory_pool<T, alignment, null_lock> pool;
+	std::atomic<bool> combining;
+	/* No slot above this has ever been claimed, so combine() stops there */
+	std::atomic<unsigned int> nr_claimed;
+	std::atomic<unsigned int> nr_owned;
+	uint64_t pool_id;
+	slot slots[nr_slots];
+
+	slot *my_slot()
+	{
+		for(auto &e : slot_cache)
+		{
+			if(e.pool_id == pool_id)
+				return e.s;
+		}
+
+		if(nr_owned.load(std::memory_order_relaxed) == nr_slots)
+			return nullptr;
+
+		void *me = &this_thread_slots;
+		slot *s = nullptr;
+
+		/* The slot may only have fallen out of the cache */
+		auto nr = nr_claimed.load(std::memory_order_relaxed);
+		for(unsigned int i = 0; i < nr && !s; i++)
+		{
+			if(slots[i].owner.load(std::memory_order_relaxed) == me)
+				s = &slots[i];
+		}
+
+		/* Otherwise take the first free one, maybe left by a thread that exited */
+		for(unsigned int i = 0; i < nr_slots && !s; i++)
+		{
+			void *expected = nullptr;
+			if(slots[i].owner.load(std::memory_order_relaxed) ||
+			   !slots[i].owner.compare_exchange_strong(expected, me, std::memory_order_acquire))
+				continue;
+
+			s = &slots[i];
+			nr_owned.fetch_add(1, std::memory_order_relaxed);
+			while(nr < i + 1 && !nr_claimed.compare_exchange_weak(nr, i + 1, std::memory_order_relaxed))
+				;
+		}
+
+		if(!s)
+			return nullptr;
+
+		auto &e = slot_cache[slot_cache_next++ % slot_cache_size];
+		e.pool_id = pool_id;
+		e.s = s;
+		return s;
+	}
+
+	bool try_lock()
+	{
+		return !combining.load(std::memory_order_relaxed) &&
+		       !combining.exchange(true, std::memory_order_acquire);
+	}
+
+	void unlock()
+	{
+		combining.store(false, std::memory_order_release);
+	}
+
+	void combine()
+	{
+		auto nr = nr_claimed.load(std::memory_order_acquire);
+
+		for(unsigned int i = 0; i < nr; i++)
+		{
+			auto &s = slots[i];
+			auto state = s.state.load(std::memory_order_acquire);
+
+			if(state == slot_allocate)
+				s.ptr = pool.allocate();
+			else if(state == slot_free)
+				pool.free(s.ptr);
+			else
+				continue;
+
+			s.state.store(slot_done, std::memory_order_release);
+		}
+	}
+
+	T *execute(slot_state op, T *ptr)
+	{
+		auto s = my_slot();
+
+		if(!s)
+		{
+			spin_waiter waiter;
+			while(!try_lock())
+				waiter.wait();
+
+			T *ret = nullptr;
+			if(op == slot_allocate)
+				ret = pool.allocate();
+			else
+				pool.free(ptr);
+			combine();
+			unlock();
+			return ret;
+		}
+
+		s->ptr = ptr;
+		s->state.store(op, std::memory_order_release);
+
+		spin_waiter waiter;
+		while(s->state.load(std::memory_order_acquire) != slot_done)
+		{
+			if(try_lock())
+			{
+				combine();
+				unlock();
+				continue;
+			}
+
+			waiter.wait();
+		}
+
+		s->state.store(slot_idle, std::memory_order_relaxed);
+		return s->ptr;
+	}
+
+public:
+	/* The inner pool has no lock of its own, so it leaves registering with
+	 * the pool_registry, and taking objects from pool_free(), to us */
+	flat_combining_pool() : pool{}, combining{false}, nr_claimed{0}, nr_owned{0},
+				pool_id{next_pool_id.fetch_add(1, std::memory_order_relaxed)}, slots{}
+	{
+		pool.set_page_owner(this);
+		pool_registry::instance().add(this);
+
+		std::scoped_lock guard{live_lock};
+		live_pools.push_back(this);
+	}
+
+	~flat_combining_pool()
+	{
+		pool_registry::instance().remove(this);
+
+		std::scoped_lock guard{live_lock};
+		live_pools.erase(std::remove(live_pools.begin(), live_pools.end(), this), live_pools.end());
+	}
+
+	flat_combining_pool(const flat_combining_pool &rhs) = delete;
+	flat_combining_pool& operator=(const flat_combining_pool &rhs) = delete;
+
+	T *allocate()
+	{
+		return execute(slot_allocate, nullptr);
+	}
+
+	void free(T *ptr)
+	{
+		execute(slot_free, ptr);
+	}
+
+	void purge()
+	{
+		spin_waiter waiter;
+		while(!try_lock())
+			waiter.wait();
+		pool.purge();
+		unlock();
+	}
+
+	bool owns(const void *ptr) const
+	{
+		return pool.owns(ptr);
+	}
+
+	bool free_ptr(void *ptr) override
+	{
+		if(!owns(ptr))
+			return false;
+
+		free(static_cast<T *>(ptr));
+		return true;
+	}
+
+	size_t reclaim() override
+	{
+		spin_waiter waiter;
+		while(!try_lock())
+			waiter.wait();
+		auto freed = pool.reclaim();
+		unlock();
+		return freed;
+	}
+
+	size_t used_objects()
+	{
+		return pool.used_objects;
+	}
+};
@@ -0,0 +1,125 @@
+#pragma once
+
+#include <cassert>
+#include <tuple>
+#include <utility>
+
+#include "memory_pool.h"
+
+/* Objects that are a Header followed by a variable number of Elems, like a
+ * struct with a flexible array member. Storage comes from one memory_pool
+ * per size class. There are four classes per power of two, so no object
+ * wastes more than a quarter of its trailing array. free() finds the class
+ * through the page map, so callers don't have to keep n around.
+ *
+ * Like memory_pool, this hands out storage and doesn't construct anything. */
+template <typename Header, typename Elem, size_t MaxElems>
+class flex_pool
+{
+private:
+	static constexpr size_t elements_offset = align_up(sizeof(Header), alignof(Elem));
+	static constexpr size_t object_alignment = alignof(Header) > alignof(Elem) ? alignof(Header) : alignof(Elem);
+
+	/* Elements that fit in class i: 1, 2, 3, 4, then 4 steps per doubling */
+	static constexpr size_t class_capacity(size_t i)
+	{
+		if(i < 4)
+			return i + 1;
+
+		size_t base = 4UL << ((i - 4) / 4);
+		return base + base / 4 * ((i - 4) % 4 + 1);
+	}
+
+	static constexpr size_t class_of(size_t n)
+	{
+		if(n <= 4)
+			return n ? n - 1 : 0;
+
+		unsigned int log = 63 - __builtin_clzl(n - 1);
+		size_t base = 1UL << log;
+		return 4 + (log - 2) * 4 + (n - 1 - base) / (base / 4);
+	}
+
+	static constexpr size_t nr_classes = class_of(MaxElems) + 1;
+
+	template <size_t I>
+	struct alignas(object_alignment) storage
+	{
+		unsigned char data[elements_offset + class_capacity(I) * sizeof(Elem)];
+	};
+
+	template <size_t... I>
+	static std::tuple<memory_pool<storage<I>>...> make_pools(std::index_sequence<I...>);
+
+	using pools_type = decltype(make_pools(std::make_index_sequence<nr_classes>{}));
+
+	pools_type pools;
+
+	template <size_t... I>
+	Header *allocate_in(size_t cls, std::index_sequence<I...>)
+	{
+		void *ptr = nullptr;
+		((I == cls && (ptr = std::get<I>(pools).allocate())) || ...);
+		return static_cast<Header *>(ptr);
+	}
+
+	template <size_t... I>
+	bool free_in(page_owner *owner, Header *ptr, std::index_sequence<I...>)
+	{
+		return ((owner == &std::get<I>(pools) &&
+			 (std::get<I>(pools).free(reinterpret_cast<storage<I> *>(ptr)), true)) || ...);
+	}
+
+	template <size_t... I>
+	flex_pool(const memory_pool_tunables &t, std::index_sequence<I...>) : pools{(static_cast<void>(I), t)...} {}
+
+	template <size_t... I>
+	size_t used_in(std::index_sequence<I...>) const
+	{
+		return (std::get<I>(pools).used_objects + ...);
+	}
+
+public:
+	static_assert(MaxElems > 0, "flex_pool needs room for at least one element");
+
+	/* Every size class gets the same tunables */
+	flex_pool(const memory_pool_tunables &t = memory_pool_tunables::from_env()) :
+		flex_pool{t, std::make_index_sequence<nr_classes>{}} {}
+
+	flex_pool(const flex_pool &rhs) = delete;
+	flex_pool& operator=(const flex_pool &rhs) = delete;
+
+	/* Storage for a Header followed by at least n Elems, or nullptr if n is
+	 * more than MaxElems or there's no memory left */
+	Header *allocate(size_t n)
+	{
+		if(n > MaxElems)
+			return nullptr;
+		return allocate_in(class_of(n), std::make_index_sequence<nr_classes>{});
+	}
+
+	/* Frees an object allocate() returned, with any n */
+	void free(Header *ptr)
+	{
+		auto owner = pool_pagemap::instance().lookup(ptr).pool;
+		[[maybe_unused]] bool freed = free_in(owner, ptr, std::make_index_sequence<nr_classes>{});
+		assert(freed);
+	}
+
+	/* The trailing array of an object */
+	static Elem *elements(Header *ptr)
+	{
+		return reinterpret_cast<Elem *>(reinterpret_cast<unsigned char *>(ptr) + elements_offset);
+	}
+
+	/* How many Elems an object allocated for n really has room for */
+	static constexpr size_t capacity(size_t n)
+	{
+		return class_capacity(class_of(n));
+	}
+
+	size_t used_objects() const
+	{
+		return used_in(std::make_index_sequence<nr_classes>{});
+	}
+};
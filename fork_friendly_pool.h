@@ -0,0 +1,216 @@
+#pragma once
+
+#include <cstdint>
+
+#include "memory_pool.h"
+
+/* A memory pool that never writes to object pages itself, for pre-fork
+ * servers. memory_pool keeps the free list links in the chunks and
+ * used_objs in the segment, so any allocate or free after fork() copies the
+ * object page it touches. Here every segment gets an out-of-band metadata
+ * block, mmap'd separately, holding its counters and a stack of free chunk
+ * indices. Object pages are only read by the allocator, and only once per
+ * free: to fetch the metadata pointer stored at the start of the segment when
+ * it was created.
+ *
+ * Segments are aligned to their (power of two) size, so the segment of any
+ * object is found by masking its address. Objects are packed back to back
+ * with no header. */
+
+template <typename T>
+struct fork_friendly_segment
+{
+	/* Start of the object segment; the first word there points back at us */
+	unsigned char *base;
+	size_t meta_size;
+	uint32_t used_objs;
+	/* Chunks below this index have been handed out at least once */
+	uint32_t carved;
+	uint32_t nr_free;
+	fork_friendly_segment<T> *prev, *next;
+	/* Indices of recycled chunks, the top of the stack is at nr_free - 1 */
+	uint32_t free_stack[];
+};
+
+template <typename T, size_t alignment = default_object_alignment<T>()>
+class fork_friendly_pool
+{
+	static_assert((alignment & (alignment - 1)) == 0, "alignment must be a power of two");
+	static_assert(alignment >= alignof(T), "alignment is smaller than the type's alignment");
+	static_assert(alignment >= object_pool_alignment && alignment <= PAGE_SIZE,
+		      "alignment must be between object_pool_alignment and PAGE_SIZE");
+private:
+	/* Segments that still have chunks to give out */
+	fork_friendly_segment<T> *partial_head;
+	std::mutex lock;
+	size_t nr_segments;
+
+	static constexpr size_t size_of_chunk()
+	{
+		return align_up(sizeof(T), alignment);
+	}
+
+	static constexpr size_t first_chunk_offset()
+	{
+		return align_up(sizeof(fork_friendly_segment<T> *), alignment);
+	}
+
+	static constexpr size_t segment_size()
+	{
+		size_t size = 64 * 1024;
+		while(size < first_chunk_offset() + size_of_chunk() * 16)
+			size <<= 1;
+		return size;
+	}
+
+	static constexpr uint32_t number_of_objects()
+	{
+		return (segment_size() - first_chunk_offset()) / size_of_chunk();
+	}
+
+	static constexpr size_t meta_size()
+	{
+		return align_up(sizeof(fork_friendly_segment<T>) + number_of_objects() * sizeof(uint32_t),
+				static_cast<size_t>(PAGE_SIZE));
+	}
+
+	static fork_friendly_segment<T> *ptr_to_segment(const T *ptr)
+	{
+		auto base = reinterpret_cast<uintptr_t>(ptr) & -segment_size();
+		return *reinterpret_cast<fork_friendly_segment<T> **>(base);
+	}
+
+	void link_partial(fork_friendly_segment<T> *seg)
+	{
+		seg->prev = nullptr;
+		seg->next = partial_head;
+		if(partial_head)
+			partial_head->prev = seg;
+		partial_head = seg;
+	}
+
+	void unlink_partial(fork_friendly_segment<T> *seg)
+	{
+		if(seg->prev)
+			seg->prev->next = seg->next;
+		else
+			partial_head = seg->next;
+
+		if(seg->next)
+			seg->next->prev = seg->prev;
+		seg->prev = seg->next = nullptr;
+	}
+
+	bool expand_pool()
+	{
+		/* Map twice the size and trim it down to get a naturally aligned segment */
+		auto size = segment_size();
+		void *region = mmap(nullptr, size * 2, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+		if(region == MAP_FAILED)
+			return false;
+
+		auto start = reinterpret_cast<uintptr_t>(region);
+		auto base = align_up(start, static_cast<uintptr_t>(size));
+		if(base != start)
+			munmap(region, base - start);
+		munmap(reinterpret_cast<void *>(base + size), start + size - base);
+
+		void *meta = mmap(nullptr, meta_size(), PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+		if(meta == MAP_FAILED)
+		{
+			munmap(reinterpret_cast<void *>(base), size);
+			return false;
+		}
+
+		auto seg = static_cast<fork_friendly_segment<T> *>(meta);
+		seg->base = reinterpret_cast<unsigned char *>(base);
+		seg->meta_size = meta_size();
+		*reinterpret_cast<fork_friendly_segment<T> **>(base) = seg;
+
+		link_partial(seg);
+		nr_segments++;
+
+		return true;
+	}
+
+	void remove_segment(fork_friendly_segment<T> *seg)
+	{
+		unlink_partial(seg);
+		munmap(seg->base, segment_size());
+		munmap(seg, seg->meta_size);
+		nr_segments--;
+	}
+
+public:
+	size_t used_objects;
+
+	fork_friendly_pool() : partial_head{nullptr}, lock{}, nr_segments{0}, used_objects{0} {}
+
+	~fork_friendly_pool()
+	{
+		assert(used_objects == 0);
+		purge();
+	}
+
+	fork_friendly_pool(const fork_friendly_pool &rhs) = delete;
+	fork_friendly_pool& operator=(const fork_friendly_pool &rhs) = delete;
+
+	T *allocate()
+	{
+		std::scoped_lock guard{lock};
+
+		if(!partial_head && !expand_pool())
+			return nullptr;
+
+		auto seg = partial_head;
+		uint32_t index;
+
+		if(seg->nr_free)
+			index = seg->free_stack[--seg->nr_free];
+		else
+			index = seg->carved++;
+
+		seg->used_objs++;
+		used_objects++;
+
+		if(!seg->nr_free && seg->carved == number_of_objects())
+			unlink_partial(seg);
+
+		return reinterpret_cast<T *>(seg->base + first_chunk_offset() + index * size_of_chunk());
+	}
+
+	void free(T *ptr)
+	{
+		auto seg = ptr_to_segment(ptr);
+		uint32_t index = (reinterpret_cast<unsigned char *>(ptr) - seg->base - first_chunk_offset()) / size_of_chunk();
+		std::scoped_lock guard{lock};
+
+		bool was_full = !seg->nr_free && seg->carved == number_of_objects();
+		seg->free_stack[seg->nr_free++] = index;
+		seg->used_objs--;
+		used_objects--;
+
+		if(was_full)
+			link_partial(seg);
+
+#ifndef OBJECT_POOL_DEFER_UNMAP
+		if(seg->used_objs == 0)
+			remove_segment(seg);
+#endif
+	}
+
+	/* Empty segments always have free chunks, so they are all on the partial list */
+	void purge()
+	{
+		std::scoped_lock guard{lock};
+		auto s = partial_head;
+
+		while(s)
+		{
+			auto next = s->next;
+			if(s->used_objs == 0)
+				remove_segment(s);
+			s = next;
+		}
+	}
+};
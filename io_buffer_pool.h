@@ -0,0 +1,286 @@
+#pragma once
+
+#include <atomic>
+#include <array>
+#include <cerrno>
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "memory_pool.h"
+
+/* A memory pool flavour for O_DIRECT/io_uring I/O. It hands out fixed-size,
+ * page-aligned buffers carved out of large segments. There is no chunk header:
+ * buffers are packed back to back so that the segments can be registered with
+ * io_uring as fixed buffers, one registered buffer per segment.
+ *
+ * free() never takes the pool lock, so buffers can be returned straight from
+ * completion handlers running on any thread. */
+class io_buffer_pool
+{
+private:
+	struct free_buffer
+	{
+		free_buffer *next;
+	};
+
+	/* io_uring can't take more than this many buffers on older kernels (UIO_MAXIOV) */
+	static constexpr size_t max_segments = 1024;
+	static constexpr size_t default_segment_size = 2 * 1024 * 1024;
+
+	const size_t buffer_size;
+	const size_t segment_size;
+	std::mutex lock;
+	free_buffer *free_head;
+	/* Buffers returned by free(), taken over in bulk by allocate() */
+	std::atomic<free_buffer *> returned_head;
+	/* Segments are published once and never change after, so buffer_index()
+	 * can look them up without the lock. */
+	std::array<iovec, max_segments> segments;
+	std::atomic<size_t> nr_segments;
+	unsigned char *bump, *bump_end;
+	int ring_fd;
+	bool sparse_registration;
+	/* Segments below this are in the ring's buffer table */
+	std::atomic<size_t> nr_registered;
+	/* The last registration failure, or 0 */
+	int registration_status;
+	std::atomic<size_t> used_buffers;
+
+	static int io_uring_register(int fd, unsigned int opcode, const void *arg, unsigned int nr_args)
+	{
+		if(syscall(__NR_io_uring_register, fd, opcode, arg, nr_args) < 0)
+			return -errno;
+		return 0;
+	}
+
+	int update_registration(size_t first_segment)
+	{
+		auto nr = nr_segments.load(std::memory_order_relaxed);
+		int st;
+
+		if(sparse_registration)
+		{
+			io_uring_rsrc_update2 update{};
+			update.offset = first_segment;
+			update.data = reinterpret_cast<__u64>(&segments[first_segment]);
+			update.nr = nr - first_segment;
+			st = io_uring_register(ring_fd, IORING_REGISTER_BUFFERS_UPDATE, &update, sizeof(update));
+		}
+		else
+		{
+			/* Old kernels can't update a registered buffer table: drop it and
+			 * register everything again. This waits for in-flight I/O to drain. */
+			if(first_segment != 0)
+			{
+				nr_registered.store(0, std::memory_order_release);
+				io_uring_register(ring_fd, IORING_UNREGISTER_BUFFERS, nullptr, 0);
+			}
+			st = io_uring_register(ring_fd, IORING_REGISTER_BUFFERS, segments.data(), nr);
+		}
+
+		if(st < 0)
+			return st;
+
+		nr_registered.store(nr, std::memory_order_release);
+		return 0;
+	}
+
+	/* Called with the lock held after the pool grew. A sparse table keeps
+	 * its older segments on failure and the next growth retries the rest;
+	 * a legacy table is gone by then, so give up on the ring. */
+	void register_new_segments()
+	{
+		auto st = update_registration(nr_registered.load(std::memory_order_relaxed));
+		if(st == 0)
+			return;
+
+		registration_status = st;
+		if(!sparse_registration)
+			unregister_buffers_locked();
+	}
+
+	bool expand_pool()
+	{
+		auto nr = nr_segments.load(std::memory_order_relaxed);
+		if(nr == max_segments)
+			return false;
+
+		void *region = mmap(nullptr, segment_size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+		if(region == MAP_FAILED)
+			return false;
+
+		segments[nr].iov_base = region;
+		segments[nr].iov_len = segment_size;
+		nr_segments.store(nr + 1, std::memory_order_release);
+
+		bump = static_cast<unsigned char *>(region);
+		bump_end = bump + segment_size;
+
+		return true;
+	}
+
+	void unregister_buffers_locked()
+	{
+		if(ring_fd < 0)
+			return;
+
+		nr_registered.store(0, std::memory_order_release);
+		io_uring_register(ring_fd, IORING_UNREGISTER_BUFFERS, nullptr, 0);
+		ring_fd = -1;
+		sparse_registration = false;
+	}
+
+public:
+	io_buffer_pool(size_t buffer_size, size_t segment_size = default_segment_size) :
+		buffer_size{align_up(buffer_size, static_cast<size_t>(PAGE_SIZE))},
+		segment_size{align_up(segment_size, this->buffer_size)}, lock{}, free_head{nullptr},
+		returned_head{nullptr}, segments{}, nr_segments{0}, bump{nullptr}, bump_end{nullptr},
+		ring_fd{-1}, sparse_registration{false}, nr_registered{0}, registration_status{0},
+		used_buffers{0} {}
+
+	~io_buffer_pool()
+	{
+		assert(used_buffers == 0);
+		unregister_buffers();
+
+		for(size_t i = 0; i < nr_segments; i++)
+			munmap(segments[i].iov_base, segments[i].iov_len);
+	}
+
+	io_buffer_pool(const io_buffer_pool &rhs) = delete;
+	io_buffer_pool& operator=(const io_buffer_pool &rhs) = delete;
+
+	void *allocate()
+	{
+		std::scoped_lock guard{lock};
+
+		if(!free_head)
+			free_head = returned_head.exchange(nullptr, std::memory_order_acquire);
+
+		used_buffers.fetch_add(1, std::memory_order_relaxed);
+
+		if(free_head)
+		{
+			auto buf = free_head;
+			free_head = buf->next;
+			return buf;
+		}
+
+		if(bump == bump_end)
+		{
+			if(!expand_pool())
+			{
+				used_buffers.fetch_sub(1, std::memory_order_relaxed);
+				return nullptr;
+			}
+
+			/* On failure buffer_index() says -1 for whatever isn't in the
+			 * table anymore, and registration_error() says why */
+			if(ring_fd >= 0)
+				register_new_segments();
+		}
+
+		auto buf = bump;
+		bump += buffer_size;
+		return buf;
+	}
+
+	/* Lock-free, safe to call from any thread. The return stack is only ever
+	 * popped as a whole by allocate(), so pushes can't suffer from ABA. */
+	void free(void *ptr)
+	{
+		auto buf = static_cast<free_buffer *>(ptr);
+		auto head = returned_head.load(std::memory_order_relaxed);
+
+		do
+		{
+			buf->next = head;
+		} while(!returned_head.compare_exchange_weak(head, buf, std::memory_order_release,
+							     std::memory_order_relaxed));
+
+		used_buffers.fetch_sub(1, std::memory_order_relaxed);
+	}
+
+	/* Registers every segment, current and future, with the ring as a fixed
+	 * buffer. Returns 0 or a negative errno. */
+	int register_buffers(int fd)
+	{
+		std::scoped_lock guard{lock};
+
+		if(ring_fd >= 0)
+			return -EBUSY;
+
+		ring_fd = fd;
+		registration_status = 0;
+
+		/* Prefer a sparse table sized for every segment we could ever have,
+		 * so growing the pool only fills in a slot instead of re-registering. */
+		io_uring_rsrc_register reg{};
+		reg.nr = max_segments;
+		reg.flags = IORING_RSRC_REGISTER_SPARSE;
+		sparse_registration = io_uring_register(ring_fd, IORING_REGISTER_BUFFERS2, &reg, sizeof(reg)) == 0;
+
+		if(nr_segments.load(std::memory_order_relaxed) == 0)
+		{
+			if(sparse_registration)
+				return 0;
+			/* Legacy registration can't be empty, so get a segment now */
+			if(!expand_pool())
+			{
+				ring_fd = -1;
+				return -ENOMEM;
+			}
+		}
+
+		auto st = update_registration(0);
+		if(st < 0)
+		{
+			unregister_buffers_locked();
+			return st;
+		}
+
+		return 0;
+	}
+
+	void unregister_buffers()
+	{
+		std::scoped_lock guard{lock};
+		unregister_buffers_locked();
+	}
+
+	/* The last error from registering buffers the pool grew into, or 0 */
+	int registration_error()
+	{
+		std::scoped_lock guard{lock};
+		return registration_status;
+	}
+
+	/* The fixed buffer index to put in sqe->buf_index for I/O on ptr, or -1
+	 * if its segment isn't registered and it can only do plain I/O */
+	int buffer_index(const void *ptr) const
+	{
+		auto p = static_cast<const unsigned char *>(ptr);
+		auto nr = nr_registered.load(std::memory_order_acquire);
+
+		for(size_t i = 0; i < nr; i++)
+		{
+			auto base = static_cast<const unsigned char *>(segments[i].iov_base);
+			if(p >= base && p < base + segments[i].iov_len)
+				return i;
+		}
+
+		return -1;
+	}
+
+	size_t size_of_buffer() const
+	{
+		return buffer_size;
+	}
+
+	size_t used() const
+	{
+		return used_buffers.load(std::memory_order_relaxed);
+	}
+};
@@ -0,0 +1,1857 @@
+#pragma once
+
+#include <iostream>
+#include <mutex>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <list>
+#include <sys/mman.h>
+#include <sys/user.h>
+#include <cassert>
+#include <utility>
+#include <cstring>
+#include <type_traits>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "pool_registry.h"
+#include "pool_budget.h"
+#include "pool_tunables.h"
+#include "pool_pagemap.h"
+#include "pool_hardening.h"
+#include "pool_reclaimer.h"
+#include "pool_locks.h"
+
+
+/* The policy is picked at compile time, and can be changed from the compiler
+ * command line without touching this file, see the matrix target in the
+ * Makefile. */
+
+/* Hand out the most recently freed chunk first, while it's still in cache,
+ * unless OBJECT_POOL_FIFO_REUSE asks for the least recently freed one */
+#ifndef OBJECT_POOL_FIFO_REUSE
+#define OBJECT_POOL_ALLOCATE_WARM_CACHE
+#endif
+/* OBJECT_POOL_CANARIES puts a canary in every chunk header */
+#ifdef OBJECT_POOL_CANARIES
+#define OBJECT_CANARY				0xcacacacacacacaca
+#endif
+/* OBJECT_POOL_DEFER_UNMAP keeps empty segments mapped until purge() */
+/* Lets memory_pool_tunables::sample_rate pick allocations to check */
+#ifndef OBJECT_POOL_NO_SAMPLED_HARDENING
+#define OBJECT_POOL_SAMPLED_HARDENING
+#endif
+
+static constexpr size_t object_pool_alignment = 16UL;
+static constexpr size_t cache_line_size = 64;
+/* Objects at least this big get zeroed with non-temporal stores by allocate_zeroed() */
+static constexpr size_t object_pool_nt_zero_threshold = PAGE_SIZE;
+
+template <typename T>
+constexpr T align_up(T number, T alignment)
+{
+	return (number + (alignment - 1)) & -alignment;
+}
+
+
+/* Objects are aligned to at least object_pool_alignment, or more if the type asks for it */
+template <typename T>
+constexpr size_t default_object_alignment()
+{
+	return alignof(T) > object_pool_alignment ? alignof(T) : object_pool_alignment;
+}
+
+template <typename T, size_t alignment = default_object_alignment<T>()>
+class memory_pool_segment;
+
+template <typename T, size_t alignment = default_object_alignment<T>()>
+struct memory_chunk
+{
+	struct memory_chunk *next;
+	memory_pool_segment<T, alignment> *segment;
+#ifdef OBJECT_CANARY
+	unsigned long object_canary;
+	unsigned long pad0;
+#endif
+	/* Note that this is 16-byte aligned */
+} __attribute__((packed));
+
+template <typename T, size_t alignment>
+class memory_pool_segment
+{
+private:
+	void *mmap_segment;
+	size_t size;
+	/* Length of the page map; a segment can grow in place up to this many
+	 * pages without its chunks moving */
+	size_t capacity_pages;
+	/* No chunk crosses a multiple of this, or 0 to pack chunks back to back */
+	size_t pack_unit;
+	/* Chunks at or above the high-water mark have never been handed out, so
+	 * their object memory is still zero from mmap. */
+	unsigned char *high_water;
+public:
+	size_t used_objs;
+	memory_pool_segment<T, alignment> *prev, *next;
+	/* Each segment keeps its own free chunks, so an empty segment can be
+	 * dropped without going through anyone else's. Segments that have free
+	 * chunks are also on the pool's partial list. */
+	memory_chunk<T, alignment> *free_head, *free_tail;
+	memory_pool_segment<T, alignment> *partial_prev, *partial_next;
+	/* Free chunks taken off the free list because they touch released pages */
+	size_t released_chunks;
+	/* Chunks in the pool's reserve for allocate_critical() */
+	size_t reserved_chunks;
+	/* When used_objs last dropped to zero, if the pool has a purge delay */
+	std::chrono::steady_clock::time_point empty_since;
+
+	memory_pool_segment(void *mmap_segment, size_t size, size_t capacity_pages, size_t pack_unit) :
+								mmap_segment{mmap_segment}, size{size},
+								capacity_pages{capacity_pages}, pack_unit{pack_unit},
+								high_water{nullptr}, used_objs{}, prev{nullptr}, next{nullptr},
+								free_head{nullptr}, free_tail{nullptr}, partial_prev{nullptr},
+								partial_next{nullptr}, released_chunks{0}, reserved_chunks{0},
+								empty_since{} {}
+	~memory_pool_segment()
+	{
+		/* If mmap_segment is null, it's an empty object(has been std::move'd) */
+		if(mmap_segment != nullptr)
+		{
+			assert(used_objs == 0);
+			//std::cout << "Freeing segment " << mmap_segment << "\n";
+			munmap(mmap_segment, max_size());
+		}
+	}
+
+	memory_pool_segment(const memory_pool_segment &rhs) = delete;
+	memory_pool_segment& operator=(const memory_pool_segment &rhs) = delete;
+
+	memory_pool_segment(memory_pool_segment&& rhs)
+	{
+		if(this == &rhs)
+			return;
+		mmap_segment = rhs.mmap_segment;
+		size = rhs.size;
+		capacity_pages = rhs.capacity_pages;
+		pack_unit = rhs.pack_unit;
+		high_water = rhs.high_water;
+		used_objs = rhs.used_objs;
+		free_head = rhs.free_head;
+		free_tail = rhs.free_tail;
+
+		rhs.mmap_segment = nullptr;
+		rhs.size = SIZE_MAX;
+		rhs.high_water = nullptr;
+		rhs.used_objs = 0;
+		rhs.free_head = rhs.free_tail = nullptr;
+	}
+
+	memory_pool_segment& operator=(memory_pool_segment&& rhs)
+	{
+		if(this == &rhs)
+			return *this;
+		mmap_segment = rhs.mmap_segment;
+		size = rhs.size;
+		capacity_pages = rhs.capacity_pages;
+		pack_unit = rhs.pack_unit;
+		high_water = rhs.high_water;
+		used_objs = rhs.used_objs;
+		free_head = rhs.free_head;
+		free_tail = rhs.free_tail;
+
+		rhs.mmap_segment = nullptr;
+		rhs.size = SIZE_MAX;
+		rhs.high_water = nullptr;
+		rhs.used_objs = 0;
+		rhs.free_head = rhs.free_tail = nullptr;
+
+		return *this;
+	}
+
+	static constexpr bool is_large_object()
+	{
+		return size_of_chunk() >= PAGE_SIZE / 8;
+	}
+	
+	static constexpr size_t default_pool_size = 2 * PAGE_SIZE;
+
+	/* The chunk header sits right before the object, so only the object needs
+	 * to be aligned; the header lives in the previous chunk's tail padding. */
+	static constexpr size_t size_of_chunk()
+	{
+		return align_up(sizeof(memory_chunk<T, alignment>) + sizeof(T), alignment);
+	}
+
+	/* The inline segment ends with the page occupancy map, so its size depends
+	 * on the number of pages in the segment */
+	static constexpr size_t size_of_inline_segment(size_t nr_pages)
+	{
+		return align_up(sizeof(memory_pool_segment<T, alignment>) + nr_pages * sizeof(uint16_t), object_pool_alignment);
+	}
+
+	static constexpr size_t first_chunk_offset(size_t nr_pages)
+	{
+		return align_up(size_of_inline_segment(nr_pages) + sizeof(memory_chunk<T, alignment>), alignment)
+			- sizeof(memory_chunk<T, alignment>);
+	}
+
+	/* The default segment size for T */
+	static constexpr size_t memory_pool_size()
+	{
+		if(is_large_object())
+		{
+			/* Grow the segment until the page map for it fits as well */
+			size_t size = align_up(size_of_chunk() * 24, PAGE_SIZE);
+			while(first_chunk_offset(size / PAGE_SIZE) + size_of_chunk() * 24 > size)
+				size += PAGE_SIZE;
+			return size;
+		}
+		else
+			return default_pool_size;
+	}
+
+	/* A segment size of at least the requested size that fits the header,
+	 * the page map and at least one chunk */
+	static constexpr size_t segment_size_for(size_t requested)
+	{
+		if(!requested)
+			return memory_pool_size();
+
+		size_t size = align_up(requested, PAGE_SIZE);
+		while(first_chunk_offset(size / PAGE_SIZE) + size_of_chunk() > size)
+			size += PAGE_SIZE;
+		return size;
+	}
+
+	/* Where the object starts in a chunk that begins at a pack unit boundary */
+	static constexpr size_t pack_pad()
+	{
+		return align_up(sizeof(memory_chunk<T, alignment>), alignment) - sizeof(memory_chunk<T, alignment>);
+	}
+
+	/* The unit to pack chunks into, or 0 if not even one chunk fits in it */
+	static constexpr size_t pack_unit_for(size_t unit)
+	{
+		return unit && pack_pad() + size_of_chunk() <= unit ? unit : 0;
+	}
+
+	/* Packed segments start with the chunks that fit between the header and
+	 * the first unit boundary, then put as many chunks in every unit as fit
+	 * without crossing into the next one. */
+	static constexpr size_t chunk_offset(size_t index, size_t capacity_pages, size_t unit)
+	{
+		auto first = first_chunk_offset(capacity_pages);
+		if(!unit)
+			return first + index * size_of_chunk();
+
+		auto base = align_up(first, unit);
+		auto head = (base - first) / size_of_chunk();
+		if(index < head)
+			return first + index * size_of_chunk();
+
+		index -= head;
+		auto per_unit = (unit - pack_pad()) / size_of_chunk();
+		return base + index / per_unit * unit + pack_pad() + index % per_unit * size_of_chunk();
+	}
+
+	static constexpr size_t number_of_objects(size_t segment_size, size_t capacity_pages, size_t unit)
+	{
+		auto first = first_chunk_offset(capacity_pages);
+		if(!unit)
+			return (segment_size - first) / size_of_chunk();
+
+		/* Segments are whole pages, so they end on a unit boundary */
+		auto base = align_up(first, unit);
+		return (base - first) / size_of_chunk() + (segment_size - base) / unit * ((unit - pack_pad()) / size_of_chunk());
+	}
+
+	static constexpr size_t number_of_objects(size_t segment_size)
+	{
+		return number_of_objects(segment_size, segment_size / PAGE_SIZE, 0);
+	}
+
+	/* Segment sizes are picked at runtime, but only the slow paths look at them */
+	size_t segment_size() const
+	{
+		return size;
+	}
+
+	size_t nr_pages() const
+	{
+		return size / PAGE_SIZE;
+	}
+
+	size_t first_chunk_offset() const
+	{
+		return first_chunk_offset(capacity_pages);
+	}
+
+	size_t max_size() const
+	{
+		return capacity_pages * PAGE_SIZE;
+	}
+
+	/* Pages the inline header and the page map take up, at least partly */
+	size_t header_pages() const
+	{
+		return (first_chunk_offset() - 1) / PAGE_SIZE + 1;
+	}
+
+	/* Adds the chunks of the pages grow_segment() just opened up to the free list.
+	 * The new pages come zeroed, so high_water stays where it is. */
+	void grow(size_t new_size)
+	{
+		auto old_objs = number_of_objects();
+		size = new_size;
+
+		for(auto i = old_objs; i < number_of_objects(); i++)
+		{
+			auto c = chunk_at(i);
+			c->segment = this;
+#ifdef OBJECT_CANARY
+			c->object_canary = OBJECT_CANARY;
+#endif
+			c->next = nullptr;
+			append_chunk_tail(c);
+		}
+	}
+
+	size_t number_of_objects() const
+	{
+		return number_of_objects(size, capacity_pages, pack_unit);
+	}
+
+	memory_chunk<T, alignment> *chunk_at(size_t index)
+	{
+		return reinterpret_cast<memory_chunk<T, alignment> *>(static_cast<unsigned char *>(mmap_segment)
+			+ chunk_offset(index, capacity_pages, pack_unit));
+	}
+
+	/* Bytes right after the object that sampled hardening may put a canary
+	 * in, if the chunk has the padding for it */
+	static constexpr size_t tail_canary_size()
+	{
+#ifdef OBJECT_POOL_SAMPLED_HARDENING
+		return size_of_chunk() - sizeof(memory_chunk<T, alignment>) - sizeof(T) >= sizeof(uintptr_t) ?
+		       sizeof(uintptr_t) : 0;
+#else
+		return 0;
+#endif
+	}
+
+	/* First and last page touched by the chunk's header, object and canary */
+	std::pair<size_t, size_t> chunk_pages(memory_chunk<T, alignment> *chunk)
+	{
+		size_t start = reinterpret_cast<unsigned char *>(chunk) - static_cast<unsigned char *>(mmap_segment);
+		auto end = start + sizeof(memory_chunk<T, alignment>) + sizeof(T) + tail_canary_size();
+		return {start / PAGE_SIZE, (end - 1) / PAGE_SIZE};
+	}
+
+	bool touches_released_page(memory_chunk<T, alignment> *chunk)
+	{
+		auto [first, last] = chunk_pages(chunk);
+		for(auto p = first; p <= last; p++)
+		{
+			if(page_used[p] == page_released)
+				return true;
+		}
+
+		return false;
+	}
+
+	void setup_chunks()
+	{
+		memory_chunk<T, alignment> *prev = nullptr;
+		auto first = chunk_at(0);
+		auto nr_objs = number_of_objects();
+
+		high_water = reinterpret_cast<unsigned char *>(first);
+
+		for(size_t i = 0; i < nr_objs; i++)
+		{
+			auto curr = chunk_at(i);
+			curr->segment = this;
+#ifdef OBJECT_CANARY
+			curr->object_canary = OBJECT_CANARY;
+#endif
+			curr->next = nullptr;
+			if(prev)	prev->next = curr;
+
+			prev = curr;
+		}
+
+		free_head = first;
+		free_tail = prev;
+
+		/* The pages with the segment header and the page map on them are
+		 * never released */
+		for(size_t p = 0; p < header_pages(); p++)
+			page_used[p] = 1;
+	}
+
+	bool has_free_chunks()
+	{
+		return free_head || released_chunks;
+	}
+
+	void get_pages(memory_chunk<T, alignment> *chunk)
+	{
+		auto [first, last] = chunk_pages(chunk);
+		for(auto p = first; p <= last; p++)
+			page_used[p]++;
+	}
+
+	void put_pages(memory_chunk<T, alignment> *chunk)
+	{
+		auto [first, last] = chunk_pages(chunk);
+		for(auto p = first; p <= last; p++)
+			page_used[p]--;
+	}
+
+	/* Gives the pages that no allocated chunk touches back to the kernel.
+	 * The free chunks on them can't stay on the free list, their headers may
+	 * be gone once the kernel takes the pages; reclaim_released_pages() puts
+	 * them back. Returns the number of bytes released. */
+	size_t release_free_pages()
+	{
+		static constexpr uint16_t page_releasing = page_released - 1;
+		size_t nr_releasing = 0;
+
+		for(size_t p = header_pages(); p < nr_pages(); p++)
+		{
+			if(page_used[p] == 0)
+			{
+				page_used[p] = page_releasing;
+				nr_releasing++;
+			}
+		}
+
+		if(!nr_releasing)
+			return 0;
+
+		memory_chunk<T, alignment> *prev = nullptr;
+		for(auto c = free_head; c; c = c->next)
+		{
+			auto [first, last] = chunk_pages(c);
+			bool drop = false;
+			for(auto p = first; p <= last; p++)
+				drop |= page_used[p] == page_releasing || page_used[p] == page_released;
+
+			if(!drop)
+			{
+				prev = c;
+				continue;
+			}
+
+			if(prev)
+				prev->next = c->next;
+			else
+				free_head = c->next;
+			if(free_tail == c)
+				free_tail = prev;
+			released_chunks++;
+		}
+
+		auto base = static_cast<unsigned char *>(mmap_segment);
+		for(size_t p = header_pages(); p < nr_pages();)
+		{
+			if(page_used[p] != page_releasing)
+			{
+				p++;
+				continue;
+			}
+
+			auto start = p;
+			while(p < nr_pages() && page_used[p] == page_releasing)
+				page_used[p++] = page_released;
+
+			/* MADV_FREE only drops the pages under memory pressure, but needs 4.5+ */
+			auto len = (p - start) * PAGE_SIZE;
+			if(madvise(base + start * PAGE_SIZE, len, MADV_FREE) < 0)
+				madvise(base + start * PAGE_SIZE, len, MADV_DONTNEED);
+		}
+
+		return nr_releasing * PAGE_SIZE;
+	}
+
+	/* Puts every chunk on a released page back on the free list. The pages
+	 * get faulted back in as their chunk headers are rewritten. */
+	void reclaim_released_pages()
+	{
+		for(size_t i = 0; i < number_of_objects(); i++)
+		{
+			auto c = chunk_at(i);
+			if(!touches_released_page(c))
+				continue;
+
+			c->segment = this;
+#ifdef OBJECT_CANARY
+			c->object_canary = OBJECT_CANARY;
+#endif
+			c->next = nullptr;
+			append_chunk_tail(c);
+		}
+
+		for(size_t p = header_pages(); p < nr_pages(); p++)
+		{
+			if(page_used[p] == page_released)
+				page_used[p] = 0;
+		}
+
+		released_chunks = 0;
+	}
+
+	memory_chunk<T, alignment> *pop_chunk()
+	{
+		auto chunk = free_head;
+
+		free_head = free_head->next;
+
+		if(!free_head)	free_tail = nullptr;
+
+		return chunk;
+	}
+
+	void append_chunk_tail(memory_chunk<T, alignment> *chunk)
+	{
+		if(!free_tail)
+		{
+			free_head = free_tail = chunk;
+		}
+		else
+		{
+			free_tail->next = chunk;
+			free_tail = chunk;
+			assert(free_head != nullptr);
+		}
+	}
+
+	void append_chunk_head(memory_chunk<T, alignment> *chunk)
+	{
+		if(!free_head)
+		{
+			free_head = free_tail = chunk;
+		}
+		else
+		{
+			auto curr_head = free_head;
+			free_head = chunk;
+			free_head->next = curr_head;
+			assert(free_tail != nullptr);
+		}
+	}
+
+	bool empty()
+	{
+		return used_objs == 0;
+	}
+
+	/* Returns true if the chunk is being handed out for the first time */
+	bool mark_used(memory_chunk<T, alignment> *chunk)
+	{
+		auto start = reinterpret_cast<unsigned char *>(chunk);
+		if(start < high_water)
+			return false;
+
+		high_water = start + size_of_chunk();
+		return true;
+	}
+
+	/* Whether ptr points at the object of one of the segment's chunks */
+	bool is_object(const void *ptr) const
+	{
+		auto offset = static_cast<const unsigned char *>(ptr) - static_cast<const unsigned char *>(mmap_segment)
+			      - static_cast<ptrdiff_t>(sizeof(memory_chunk<T, alignment>));
+		auto first = static_cast<ptrdiff_t>(first_chunk_offset());
+		if(offset < first)
+			return false;
+
+		size_t index = (offset - first) / size_of_chunk();
+		if(pack_unit && static_cast<size_t>(offset) >= align_up(first_chunk_offset(), pack_unit))
+		{
+			/* Find the unit, then the slot in it */
+			auto base = align_up(first_chunk_offset(), pack_unit);
+			auto per_unit = (pack_unit - pack_pad()) / size_of_chunk();
+			auto in_unit = (offset - base) % pack_unit;
+			if(in_unit < pack_pad())
+				return false;
+			index = (base - first) / size_of_chunk() + (offset - base) / pack_unit * per_unit
+				+ (in_unit - pack_pad()) / size_of_chunk();
+		}
+
+		return index < number_of_objects() &&
+		       chunk_offset(index, capacity_pages, pack_unit) == static_cast<size_t>(offset);
+	}
+
+	bool operator==(const memory_pool_segment<T, alignment> &rhs)
+	{
+		return mmap_segment == rhs.mmap_segment;
+	}
+
+	void *get_mmap_segment()
+	{
+		return mmap_segment;
+	}
+
+	/* Number of allocated chunks touching each page of the segment, or
+	 * page_released if the page has been given back to the kernel */
+	static constexpr uint16_t page_released = UINT16_MAX;
+	uint16_t page_used[];
+};
+
+/* Lock is any BasicLockable type, see pool_locks.h for ones suited to the
+ * short allocate/free critical sections */
+template <typename T, size_t alignment = default_object_alignment<T>(), typename Lock = std::mutex>
+class memory_pool : public reclaimable_pool, public page_owner, public async_freeable
+{
+	static_assert((alignment & (alignment - 1)) == 0, "alignment must be a power of two");
+	static_assert(alignment >= alignof(T), "alignment is smaller than the type's alignment");
+	static_assert(alignment >= object_pool_alignment && alignment <= PAGE_SIZE,
+		      "alignment must be between object_pool_alignment and PAGE_SIZE");
+private:
+	/* Segments that have free chunks, allocations come from the first one */
+	memory_pool_segment<T, alignment> *partial_head, *partial_tail;
+	Lock lock;
+	memory_pool_segment<T, alignment> *segment_head, *segment_tail;
+	/* Where the next incremental purge() picks up */
+	memory_pool_segment<T, alignment> *purge_cursor;
+	size_t nr_objects;
+	memory_pool_tunables tunables;
+	/* Empty segments still mapped, at most tunables.empty_segments of them
+	 * unless OBJECT_POOL_DEFER_UNMAP keeps them all */
+	size_t nr_empty_segments;
+	memory_pool_stats counters;
+	/* What the slow paths did since the last self-tuning decision */
+	struct
+	{
+		std::chrono::steady_clock::time_point start;
+		size_t expansions;
+		/* Empty segments unmapped by free() because the cache was full */
+		size_t empty_unmaps;
+		/* Allocations that took an empty segment out of the cache */
+		size_t empty_reuses;
+		/* Windows in a row with nothing to react to */
+		size_t quiet;
+	} tune_window;
+	/* Where self-tuning goes back to once the pool calms down */
+	size_t base_segment_size, base_empty_segments;
+	/* See chunk_layout */
+	size_t pack_unit;
+	/* What the page map points the pool's pages at */
+	page_owner *owner;
+#ifdef OBJECT_POOL_SAMPLED_HARDENING
+	/* Allocations to go until the next sampled one */
+	size_t sample_countdown;
+	uint64_t sample_rng;
+	uintptr_t sample_key;
+	guarded_slots guarded;
+	/* Freed sampled chunks, poisoned, until they get checked and really freed */
+	static constexpr size_t quarantine_size = 16;
+	memory_chunk<T, alignment> *quarantine[quarantine_size];
+	size_t quarantine_next;
+#endif
+	pool_budget *budget;
+	/* Bytes reserved from the budget that no segment is using yet */
+	size_t budget_credit;
+	/* Set when a reservation went past the soft limit; the budget gets shed
+	 * once the lock is dropped */
+	bool shed_pending;
+	/* Objects handed to the pool_reclaimer and not freed yet */
+	std::atomic<size_t> async_pending;
+	/* Chunks only allocate_critical() hands out, linked through next. They
+	 * count as used in their segments, but not in used_objects. */
+	memory_chunk<T, alignment> *reserve_head;
+	size_t nr_reserved;
+
+	/* Without a real lock, reclaim() can't run from the registry's monitor
+	 * thread or another pool's budget shedding. Whatever wraps such a pool
+	 * (see flat_combining_pool) reclaims it under its own serialization. */
+	static constexpr bool shared_reclaim = !std::is_same_v<Lock, null_lock>;
+
+	static constexpr size_t purge_batch = 16;
+	static constexpr size_t huge_page_size = 2 * 1024 * 1024;
+
+	size_t budget_batch() const
+	{
+		return 4 * tunables.segment_size;
+	}
+
+	bool charge_budget(size_t size)
+	{
+		if(budget_credit < size)
+		{
+			auto batch = std::max(size, budget_batch());
+			if(budget->reserve(batch))
+				budget_credit += batch;
+			else if(batch != size && budget->reserve(size))
+				budget_credit += size;
+			else
+				return false;
+
+			shed_pending = budget->over_soft_limit();
+		}
+
+		budget_credit -= size;
+		return true;
+	}
+
+	void uncharge_budget(size_t size)
+	{
+		budget_credit += size;
+
+		/* Keep a batch around for the next expansion and give the rest back,
+		 * or give it all back if the budget is tight */
+		if(budget->over_soft_limit())
+		{
+			budget->release(budget_credit);
+			budget_credit = 0;
+		}
+		else if(budget_credit > 2 * budget_batch())
+		{
+			budget->release(budget_credit - budget_batch());
+			budget_credit = budget_batch();
+		}
+	}
+
+	void log_tuning(const char *what, size_t from, size_t to)
+	{
+		if(tunables.stats)
+			counters.tuning_decisions++;
+		if(tunables.log_tuning)
+			std::fprintf(stderr, "memory_pool %p: %s %zu -> %zu (%zu expansions, %zu empty segments unmapped)\n",
+				     static_cast<void *>(this), what, from, to, tune_window.expansions, tune_window.empty_unmaps);
+	}
+
+	/* Runs on the slow paths, once every tune_interval, or right away if forced */
+	void tune(bool force = false)
+	{
+		auto now = std::chrono::steady_clock::now();
+		auto elapsed = now - tune_window.start;
+		if(elapsed < tunables.tune_interval && !force)
+			return;
+
+		bool quiet = true;
+
+		/* Segments were unmapped and then mapped again: cache more of them */
+		if(std::min(tune_window.expansions, tune_window.empty_unmaps) &&
+		   tunables.empty_segments < tunables.max_empty_segments)
+		{
+			auto to = std::min(tunables.max_empty_segments, std::max<size_t>(1, 2 * tunables.empty_segments));
+			log_tuning("empty segment cache", tunables.empty_segments, to);
+			tunables.empty_segments = to;
+			quiet = false;
+		}
+
+		/* Growing by more than a few segments per interval: take bigger steps */
+		if(tune_window.expansions * tunables.tune_interval >= 4 * elapsed && tune_window.expansions >= 4 &&
+		   tunables.segment_size < tunables.max_segment_size)
+		{
+			auto to = memory_pool_segment<T, alignment>::segment_size_for(
+					std::min(tunables.max_segment_size, 2 * tunables.segment_size));
+			log_tuning("segment size", tunables.segment_size, to);
+			tunables.segment_size = to;
+			quiet = false;
+		}
+		else if(tune_window.expansions || tune_window.empty_reuses)
+			quiet = false;
+
+		tune_window.quiet = quiet ? tune_window.quiet + 1 : 0;
+
+		/* Nothing happened for a while, drift back to the configured values */
+		if(tune_window.quiet >= 8)
+		{
+			if(tunables.empty_segments > base_empty_segments)
+			{
+				auto to = std::max(base_empty_segments, tunables.empty_segments / 2);
+				log_tuning("empty segment cache", tunables.empty_segments, to);
+				tunables.empty_segments = to;
+			}
+
+			if(tunables.segment_size > base_segment_size)
+			{
+				auto to = std::max(base_segment_size, memory_pool_segment<T, alignment>::segment_size_for(
+								tunables.segment_size / 2));
+				log_tuning("segment size", tunables.segment_size, to);
+				tunables.segment_size = to;
+			}
+
+			tune_window.quiet = 0;
+		}
+
+		tune_window.start = now;
+		tune_window.expansions = tune_window.empty_unmaps = tune_window.empty_reuses = 0;
+	}
+
+	/* Called by free() when a segment has just become empty */
+	bool keep_empty_segment(memory_pool_segment<T, alignment> *seg)
+	{
+		if(budget && budget->over_soft_limit())
+			return false;
+
+		if(tunables.self_tune)
+			tune();
+
+#ifndef OBJECT_POOL_DEFER_UNMAP
+		if(nr_empty_segments >= tunables.empty_segments)
+		{
+			tune_window.empty_unmaps++;
+			return false;
+		}
+#endif
+
+		nr_empty_segments++;
+		if(tunables.purge_delay.count())
+			seg->empty_since = std::chrono::steady_clock::now();
+		return true;
+	}
+
+	void append_segment(memory_pool_segment<T, alignment> *seg)
+	{
+		if(!segment_head)
+		{
+			segment_head = segment_tail = seg;
+		}
+		else
+		{
+			segment_tail->next = seg;
+			seg->prev = segment_tail;
+			segment_tail = seg;
+		}
+	}
+
+	void link_partial(memory_pool_segment<T, alignment> *seg)
+	{
+#ifndef OBJECT_POOL_ALLOCATE_WARM_CACHE
+		seg->partial_next = nullptr;
+		seg->partial_prev = partial_tail;
+		if(partial_tail)
+			partial_tail->partial_next = seg;
+		else
+			partial_head = seg;
+		partial_tail = seg;
+#else
+		seg->partial_prev = nullptr;
+		seg->partial_next = partial_head;
+		if(partial_head)
+			partial_head->partial_prev = seg;
+		else
+			partial_tail = seg;
+		partial_head = seg;
+#endif
+	}
+
+	void unlink_partial(memory_pool_segment<T, alignment> *seg)
+	{
+		if(seg->partial_prev)
+			seg->partial_prev->partial_next = seg->partial_next;
+		else
+			partial_head = seg->partial_next;
+
+		if(seg->partial_next)
+			seg->partial_next->partial_prev = seg->partial_prev;
+		else
+			partial_tail = seg->partial_prev;
+
+		seg->partial_prev = seg->partial_next = nullptr;
+	}
+
+	/* Takes the segment out of the pool; the caller unmaps it, preferably
+	 * after dropping the lock. */
+	void remove_segment(memory_pool_segment<T, alignment> *seg)
+	{
+		if(seg->prev)
+		{
+			seg->prev->next = seg->next;
+		}
+		else
+			segment_head = seg->next;
+		
+		if(seg->next)
+			seg->next->prev = seg->prev;
+		else
+			segment_tail = seg->prev;
+
+		/* Empty segments always have free chunks */
+		unlink_partial(seg);
+
+		if(purge_cursor == seg)
+			purge_cursor = seg->next;
+
+		nr_objects -= seg->number_of_objects();
+		pool_pagemap::instance().clear(seg->get_mmap_segment(), seg->segment_size());
+
+		if(budget)
+			uncharge_budget(seg->segment_size());
+		if(tunables.stats)
+			counters.segments_unmapped++;
+	}
+
+	/* Returns the number of bytes unmapped */
+	static size_t destroy_segments(memory_pool_segment<T, alignment> *seg)
+	{
+		size_t freed = 0;
+
+		while(seg)
+		{
+			auto next = seg->next;
+			freed += seg->segment_size();
+			seg->~memory_pool_segment();
+			seg = next;
+		}
+
+		return freed;
+	}
+
+	/* Segments that became empty after this time are spared */
+	bool purge_step(size_t budget, size_t &freed, std::chrono::steady_clock::time_point empty_before)
+	{
+		memory_pool_segment<T, alignment> *dead = nullptr;
+		bool done;
+
+		{
+			std::scoped_lock guard{lock};
+			auto s = purge_cursor ? purge_cursor : segment_head;
+
+			if(tunables.self_tune)
+				tune();
+
+			for(; s && budget; budget--)
+			{
+				auto next = s->next;
+				if(s->empty() && s->empty_since <= empty_before)
+				{
+					remove_segment(s);
+					nr_empty_segments--;
+					s->next = dead;
+					dead = s;
+				}
+
+				s = next;
+			}
+
+			purge_cursor = s;
+			done = s == nullptr;
+		}
+
+		freed += destroy_segments(dead);
+		return done;
+	}
+
+	/* Maps size bytes, followed by address space reserved for growing the
+	 * segment up to reserve bytes */
+	void *map_segment(size_t size, size_t reserve)
+	{
+		bool huge = tunables.huge_pages && size >= huge_page_size;
+		int prot = reserve > size ? PROT_NONE : PROT_WRITE | PROT_READ;
+		int flags = MAP_ANONYMOUS | MAP_PRIVATE | (reserve > size ? MAP_NORESERVE : 0);
+
+		/* For huge pages, map a huge page more than needed and trim it, so
+		 * that the segment starts on a huge page boundary */
+		auto extra = huge ? huge_page_size : 0;
+		void *region = mmap(nullptr, reserve + extra, prot, flags, -1, 0);
+		if(region == MAP_FAILED)
+			return region;
+
+		auto start = reinterpret_cast<uintptr_t>(region);
+		auto base = huge ? align_up(start, static_cast<uintptr_t>(huge_page_size)) : start;
+		if(base != start)
+			munmap(region, base - start);
+		if(extra)
+			munmap(reinterpret_cast<void *>(base + reserve), start + extra - base);
+
+		auto segment = reinterpret_cast<void *>(base);
+		if(reserve > size && mprotect(segment, size, PROT_WRITE | PROT_READ) < 0)
+		{
+			munmap(segment, reserve);
+			return MAP_FAILED;
+		}
+
+		if(huge)
+			madvise(segment, reserve, MADV_HUGEPAGE);
+		return segment;
+	}
+
+	/* Extends the segment by up to step bytes into the address space it
+	 * reserved, so a growing pool stays in a few big mappings. */
+	bool grow_segment(memory_pool_segment<T, alignment> *seg, size_t step)
+	{
+		auto old_size = seg->segment_size();
+		auto new_size = std::min(old_size + step, seg->max_size());
+		if(new_size <= old_size)
+			return false;
+
+		auto delta = new_size - old_size;
+		if(budget && !charge_budget(delta))
+			return false;
+
+		auto base = static_cast<unsigned char *>(seg->get_mmap_segment());
+		if(!pool_pagemap::instance().set(base + old_size, delta, owner, base) ||
+		   mprotect(base + old_size, delta, PROT_WRITE | PROT_READ) < 0)
+		{
+			pool_pagemap::instance().clear(base + old_size, delta);
+			if(budget)
+				uncharge_budget(delta);
+			return false;
+		}
+
+		apply_numa_policy(base + old_size, delta, tunables.numa);
+
+		bool had_free_chunks = seg->has_free_chunks();
+		auto old_objs = seg->number_of_objects();
+		seg->grow(new_size);
+		nr_objects += seg->number_of_objects() - old_objs;
+
+		if(!had_free_chunks && seg->has_free_chunks())
+			link_partial(seg);
+
+		if(tunables.stats)
+			counters.segments_grown++;
+		return true;
+	}
+
+	bool expand_pool()
+	{
+		//std::cout << "Expanding pool.\n";
+		if(tunables.self_tune)
+			tune();
+
+		auto allocation_size = tunables.segment_size;
+		tune_window.expansions++;
+
+		if(tunables.grow_in_place && segment_tail && grow_segment(segment_tail, allocation_size))
+			return true;
+
+		/* Over the hard limit we fail right away, before trying to map anything */
+		if(budget && !charge_budget(allocation_size))
+		{
+			if(tunables.stats)
+				counters.failed_expansions++;
+			return false;
+		}
+
+		/* Room in the page map for growing up to max_segment_size, unless that
+		 * would leave no room for chunks */
+		auto capacity_pages = allocation_size / PAGE_SIZE;
+		if(tunables.grow_in_place)
+		{
+			auto max_pages = std::max(capacity_pages, tunables.max_segment_size / PAGE_SIZE);
+			if(memory_pool_segment<T, alignment>::number_of_objects(allocation_size, max_pages, pack_unit))
+				capacity_pages = max_pages;
+		}
+
+		void *new_mmap_region = map_segment(allocation_size, capacity_pages * PAGE_SIZE);
+		if(new_mmap_region == MAP_FAILED)
+		{
+			if(budget)
+				uncharge_budget(allocation_size);
+			if(tunables.stats)
+				counters.failed_expansions++;
+			return false;
+		}
+
+		if(!pool_pagemap::instance().set(new_mmap_region, allocation_size, owner, new_mmap_region))
+		{
+			pool_pagemap::instance().clear(new_mmap_region, allocation_size);
+			munmap(new_mmap_region, capacity_pages * PAGE_SIZE);
+			if(budget)
+				uncharge_budget(allocation_size);
+			if(tunables.stats)
+				counters.failed_expansions++;
+			return false;
+		}
+
+		apply_numa_policy(new_mmap_region, allocation_size, tunables.numa);
+		if(tunables.stats)
+			counters.segments_mapped++;
+
+		memory_pool_segment<T, alignment> seg{new_mmap_region, allocation_size, capacity_pages, pack_unit};
+
+		nr_objects += seg.number_of_objects();
+		nr_empty_segments++;
+
+		//std::cout << "Added " << new_mmap_region << " size " << allocation_size << "\n";
+	
+		memory_pool_segment<T, alignment> &mmap_seg = *static_cast<memory_pool_segment<T, alignment> *>(new_mmap_region);
+		mmap_seg = std::move(seg);
+
+		mmap_seg.setup_chunks();
+
+		append_segment(&mmap_seg);
+		link_partial(&mmap_seg);
+
+		return true;
+	}
+
+	inline memory_chunk<T, alignment> *ptr_to_chunk(T *ptr)
+	{
+		/* Memory is layed out like this:
+		 * ----------------------------------
+		 * memory_chunk<T>
+		 * ..................................
+		 * T data
+		 * ..................................
+		 * Possible padding in between chunks
+		 * ----------------------------------*/
+
+		memory_chunk<T, alignment> *c = reinterpret_cast<memory_chunk<T, alignment> *>(ptr) - 1;
+		return c;
+	}
+
+	memory_chunk<T, alignment> *allocate_segment_chunk(bool &fresh)
+	{
+		while(!partial_head)
+		{
+			if(!expand_pool())
+			{
+				//std::cout << "mmap failed\n";
+				return nullptr;
+			}
+
+			fill_reserve();
+		}
+
+		auto seg = partial_head;
+		if(seg->empty())
+			tune_window.empty_reuses++;
+		used_objects++;
+
+		return take_chunk(seg, fresh);
+	}
+
+	/* Takes a free chunk off a segment on the partial list */
+	memory_chunk<T, alignment> *take_chunk(memory_pool_segment<T, alignment> *seg, bool &fresh)
+	{
+		if(!seg->free_head)
+			seg->reclaim_released_pages();
+
+		auto return_chunk = seg->pop_chunk();
+
+		if(!seg->has_free_chunks())	unlink_partial(seg);
+
+		seg->get_pages(return_chunk);
+		if(seg->empty())
+			nr_empty_segments--;
+		seg->used_objs++;
+
+		fresh = seg->mark_used(return_chunk);
+
+#ifdef OBJECT_CANARY
+		assert(return_chunk->object_canary == OBJECT_CANARY);
+#endif
+
+		return return_chunk;
+	}
+
+	/* Reserved chunks keep their segment from being unmapped, so the reserve
+	 * comes from segments that already hold some of it, or else from ones
+	 * that live objects keep around anyway */
+	memory_pool_segment<T, alignment> *reserve_source()
+	{
+		memory_pool_segment<T, alignment> *in_use = nullptr;
+
+		for(auto s = partial_head; s; s = s->partial_next)
+		{
+			if(s->reserved_chunks)
+				return s;
+			if(!in_use && !s->empty())
+				in_use = s;
+		}
+
+		return in_use ? in_use : partial_head;
+	}
+
+	void reserve_chunk(memory_chunk<T, alignment> *chunk)
+	{
+		chunk->segment->reserved_chunks++;
+		chunk->next = reserve_head;
+		reserve_head = chunk;
+		nr_reserved++;
+	}
+
+	/* Tops up the reserve from the segments that have free chunks, after
+	 * mapping a segment. Never maps one itself, and doesn't count as the
+	 * pool being busy for self-tuning. */
+	void fill_reserve()
+	{
+		bool fresh;
+
+		while(nr_reserved < tunables.reserved_objects && partial_head)
+			reserve_chunk(take_chunk(reserve_source(), fresh));
+	}
+
+	memory_chunk<T, alignment> *take_reserved()
+	{
+		auto chunk = reserve_head;
+		reserve_head = chunk->next;
+		chunk->next = nullptr;
+		chunk->segment->reserved_chunks--;
+		nr_reserved--;
+		return chunk;
+	}
+
+	/* Like release_chunk(), but refills the reserve first, as long as that
+	 * doesn't pin one more segment: the chunk has to come from a segment
+	 * with reserved chunks, or one that stays in use, if the reserve ran dry */
+	memory_pool_segment<T, alignment> *release_or_reserve(memory_chunk<T, alignment> *chunk)
+	{
+		auto seg = chunk->segment;
+		bool pinned = seg->reserved_chunks || (!nr_reserved && seg->used_objs > 1);
+
+		if(nr_reserved >= tunables.reserved_objects || !pinned)
+			return release_chunk(chunk);
+
+		reserve_chunk(chunk);
+		return nullptr;
+	}
+
+#ifdef OBJECT_POOL_SAMPLED_HARDENING
+	size_t next_sample_interval()
+	{
+		if(!tunables.sample_rate)
+			return SIZE_MAX;
+
+		sample_rng ^= sample_rng << 13;
+		sample_rng ^= sample_rng >> 7;
+		sample_rng ^= sample_rng << 17;
+		/* Anywhere from 1 to 2 * sample_rate - 1, so that a program can't
+		 * allocate in lockstep with the sampling */
+		return 1 + sample_rng % (2 * tunables.sample_rate - 1);
+	}
+
+	/* Sampled chunks keep this in their next field while they are allocated.
+	 * It's odd, so it's never a free list link. */
+	uintptr_t sample_marker(const memory_chunk<T, alignment> *chunk) const
+	{
+		return (reinterpret_cast<uintptr_t>(chunk) ^ sample_key) | 1;
+	}
+
+	/* ...and this once they're in quarantine, so freeing them twice shows */
+	uintptr_t quarantine_marker(const memory_chunk<T, alignment> *chunk) const
+	{
+		return sample_marker(chunk) ^ 2;
+	}
+
+	/* Bytes of padding after the object, where a canary can go */
+	static constexpr size_t tail_room()
+	{
+		return memory_pool_segment<T, alignment>::size_of_chunk() - sizeof(memory_chunk<T, alignment>) - sizeof(T);
+	}
+
+	static unsigned char *tail_of(memory_chunk<T, alignment> *chunk)
+	{
+		return reinterpret_cast<unsigned char *>(chunk + 1) + sizeof(T);
+	}
+
+	/* chunk_pages() counts the canary's bytes, so its page stays in use */
+	void write_tail_canary(memory_chunk<T, alignment> *chunk)
+	{
+		if constexpr(tail_room() >= sizeof(uintptr_t))
+		{
+			auto canary = sample_marker(chunk);
+			memcpy(tail_of(chunk), &canary, sizeof(canary));
+		}
+	}
+
+	memory_chunk<T, alignment> *allocate_guarded()
+	{
+		if(!guarded.mapped())
+		{
+			if(!guarded.map(sizeof(memory_chunk<T, alignment>) + sizeof(T) + alignment, tunables.guarded_slots))
+				return nullptr;
+			pool_pagemap::instance().set(guarded.base(), guarded.size(), owner, nullptr);
+		}
+
+		auto end = guarded.take();
+		if(!end)
+			return nullptr;
+
+		/* As close to the guard page as the alignment allows */
+		auto obj = (reinterpret_cast<uintptr_t>(end) - sizeof(T)) & -alignment;
+		auto chunk = reinterpret_cast<memory_chunk<T, alignment> *>(obj) - 1;
+		chunk->segment = nullptr;
+#ifdef OBJECT_CANARY
+		chunk->object_canary = OBJECT_CANARY;
+#endif
+		return chunk;
+	}
+
+	memory_chunk<T, alignment> *allocate_sampled(bool &fresh)
+	{
+		sample_countdown = next_sample_interval();
+
+		auto chunk = tunables.guarded_slots ? allocate_guarded() : nullptr;
+		if(chunk)
+		{
+			used_objects++;
+			/* Slots come back zeroed */
+			fresh = true;
+		}
+		else
+		{
+			chunk = allocate_segment_chunk(fresh);
+			if(!chunk)
+				return nullptr;
+
+			write_tail_canary(chunk);
+		}
+
+		chunk->next = reinterpret_cast<memory_chunk<T, alignment> *>(sample_marker(chunk));
+		return chunk;
+	}
+
+	/* Checks a chunk coming out of quarantine and frees it for real */
+	memory_pool_segment<T, alignment> *release_quarantined(memory_chunk<T, alignment> *chunk)
+	{
+		auto obj = reinterpret_cast<unsigned char *>(chunk + 1);
+
+		if(reinterpret_cast<uintptr_t>(chunk->next) != quarantine_marker(chunk))
+			report_pool_corruption("chunk header overwritten after free", obj);
+		for(size_t i = 0; i < sizeof(T); i++)
+		{
+			if(obj[i] != sample_poison)
+				report_pool_corruption("object written to after free", obj);
+		}
+
+		return release_chunk(chunk);
+	}
+
+	/* Returns the segments that went away, linked through next */
+	memory_pool_segment<T, alignment> *drain_quarantine()
+	{
+		memory_pool_segment<T, alignment> *dead = nullptr;
+
+		for(auto &chunk : quarantine)
+		{
+			if(!chunk)
+				continue;
+
+			if(auto seg = release_quarantined(chunk))
+			{
+				seg->next = dead;
+				dead = seg;
+			}
+
+			chunk = nullptr;
+		}
+
+		return dead;
+	}
+
+	void free_sampled(memory_chunk<T, alignment> *chunk)
+	{
+		auto obj = reinterpret_cast<unsigned char *>(chunk + 1);
+		memory_pool_segment<T, alignment> *dead = nullptr;
+
+		{
+			std::scoped_lock guard{lock};
+
+			if(reinterpret_cast<uintptr_t>(chunk->next) != sample_marker(chunk))
+				report_pool_corruption("chunk header overwritten, or object freed twice", obj);
+
+			used_objects--;
+
+			if(!chunk->segment)
+			{
+				guarded.give_back(obj);
+				return;
+			}
+
+			if constexpr(tail_room() >= sizeof(uintptr_t))
+			{
+				auto canary = sample_marker(chunk);
+				if(memcmp(tail_of(chunk), &canary, sizeof(canary)))
+					report_pool_corruption("write past the end of the object", obj);
+			}
+
+			memset(obj, sample_poison, sizeof(T));
+			chunk->next = reinterpret_cast<memory_chunk<T, alignment> *>(quarantine_marker(chunk));
+
+			auto victim = std::exchange(quarantine[quarantine_next], chunk);
+			quarantine_next = (quarantine_next + 1) % quarantine_size;
+			if(victim)
+				dead = release_quarantined(victim);
+		}
+
+		if(dead)
+			dead->~memory_pool_segment();
+	}
+#endif
+
+	template <typename P>
+	void free_batch(P *ptrs, size_t n)
+	{
+		memory_pool_segment<T, alignment> *dead = nullptr;
+		size_t first = 0;
+
+#ifdef OBJECT_POOL_SAMPLED_HARDENING
+		/* Sampled objects go first, and get checked one by one */
+		for(size_t i = 0; i < n; i++)
+		{
+			auto chunk = ptr_to_chunk(static_cast<T *>(ptrs[i]));
+			if(reinterpret_cast<uintptr_t>(chunk->next) & 1)
+				std::swap(ptrs[first++], ptrs[i]);
+		}
+
+		for(size_t i = 0; i < first; i++)
+			free_sampled(ptr_to_chunk(static_cast<T *>(ptrs[i])));
+#endif
+
+		{
+			std::scoped_lock guard{lock};
+			for(size_t i = first; i < n; i++)
+			{
+				used_objects--;
+				if(auto seg = release_or_reserve(ptr_to_chunk(static_cast<T *>(ptrs[i]))))
+				{
+					seg->next = dead;
+					dead = seg;
+				}
+			}
+		}
+
+		destroy_segments(dead);
+	}
+
+	memory_chunk<T, alignment> *allocate_chunk(bool &fresh)
+	{
+#ifdef OBJECT_POOL_SAMPLED_HARDENING
+		if(--sample_countdown == 0)
+			return allocate_sampled(fresh);
+#endif
+		return allocate_segment_chunk(fresh);
+	}
+
+	/* Puts the chunk back on its segment's free list. Returns the segment if
+	 * that made it go away; the caller destroys it after dropping the lock. */
+	memory_pool_segment<T, alignment> *release_chunk(memory_chunk<T, alignment> *chunk)
+	{
+		auto seg = chunk->segment;
+
+		chunk->next = nullptr;
+#ifdef OBJECT_CANARY
+		assert(chunk->object_canary == OBJECT_CANARY);
+#endif
+
+		if(!seg->has_free_chunks())
+			link_partial(seg);
+
+#ifndef OBJECT_POOL_ALLOCATE_WARM_CACHE
+		seg->append_chunk_tail(chunk);
+#else
+		seg->append_chunk_head(chunk);
+#endif
+
+		seg->put_pages(chunk);
+		seg->used_objs--;
+
+		if(seg->empty() && !keep_empty_segment(seg))
+		{
+			remove_segment(seg);
+			return seg;
+		}
+
+		return nullptr;
+	}
+
+	static void zero_object(T *ptr)
+	{
+		constexpr size_t size = align_up(sizeof(T), object_pool_alignment);
+#ifdef __SSE2__
+		if constexpr(size >= object_pool_nt_zero_threshold)
+		{
+			/* Large objects would just evict the rest of the cache, stream them out instead */
+			auto p = reinterpret_cast<__m128i *>(ptr);
+			const auto zero = _mm_setzero_si128();
+			for(size_t i = 0; i < size / sizeof(__m128i); i++)
+				_mm_stream_si128(p + i, zero);
+			_mm_sfence();
+			return;
+		}
+#endif
+		memset(static_cast<void *>(ptr), 0, size);
+	}
+
+public:
+	size_t used_objects;
+
+	memory_pool(const memory_pool_tunables &t = memory_pool_tunables::from_env()) : partial_head{nullptr},
+			partial_tail{nullptr}, lock{}, segment_head{}, segment_tail{}, purge_cursor{nullptr}, nr_objects{0},
+			tunables{t}, nr_empty_segments{0}, counters{}, tune_window{},
+			base_segment_size{}, base_empty_segments{}, pack_unit{}, owner{this},
+#ifdef OBJECT_POOL_SAMPLED_HARDENING
+			sample_countdown{}, sample_rng{}, sample_key{}, guarded{}, quarantine{}, quarantine_next{0},
+#endif
+			budget{nullptr}, budget_credit{0},
+			shed_pending{false}, async_pending{0}, reserve_head{nullptr}, nr_reserved{0}, used_objects{0}
+	{
+		using segment = memory_pool_segment<T, alignment>;
+
+		if(tunables.layout == chunk_layout::page)
+			pack_unit = segment::pack_unit_for(PAGE_SIZE);
+		else if(tunables.layout == chunk_layout::cache_line)
+			pack_unit = segment::pack_unit_for(cache_line_size);
+
+		tunables.segment_size = segment::segment_size_for(tunables.segment_size);
+		while(!segment::number_of_objects(tunables.segment_size, tunables.segment_size / PAGE_SIZE, pack_unit))
+			tunables.segment_size += PAGE_SIZE;
+		base_segment_size = tunables.segment_size;
+		base_empty_segments = tunables.empty_segments;
+
+#ifdef OBJECT_POOL_SAMPLED_HARDENING
+		/* Doesn't have to be unpredictable, just different for every pool and run */
+		sample_rng = (reinterpret_cast<uintptr_t>(this) ^
+			      std::chrono::steady_clock::now().time_since_epoch().count()) * 0x9e3779b97f4a7c15 | 1;
+		sample_key = sample_rng << 1;
+		sample_countdown = next_sample_interval();
+#endif
+		tune_window.start = std::chrono::steady_clock::now();
+		if constexpr(shared_reclaim)
+			pool_registry::instance().add(this);
+	}
+
+	memory_pool(const memory_pool &rhs) = delete;
+	memory_pool& operator=(const memory_pool &rhs) = delete;
+
+	void print_segments()
+	{
+	}
+
+	~memory_pool()
+	{
+		if constexpr(shared_reclaim)
+			pool_registry::instance().remove(this);
+		if(async_pending.load(std::memory_order_acquire))
+			pool_reclaimer::instance().drain();
+		assert(used_objects == 0);
+		size_t freed = 0;
+		purge_cursor = nullptr;
+#ifdef OBJECT_POOL_SAMPLED_HARDENING
+		destroy_segments(drain_quarantine());
+		if(guarded.mapped())
+			pool_pagemap::instance().clear(guarded.base(), guarded.size());
+#endif
+		while(reserve_head)
+		{
+			if(auto dead = release_chunk(take_reserved()))
+				dead->~memory_pool_segment();
+		}
+
+		purge_step(SIZE_MAX, freed, std::chrono::steady_clock::time_point::max());
+
+		if(budget)
+		{
+			budget->detach(this);
+			budget->release(budget_credit);
+		}
+	}
+
+	/* Charges the pool's segments to a budget; must be set before the pool
+	 * maps its first segment. Pools with a null_lock are charged, but not
+	 * asked to shed. */
+	void set_budget(pool_budget *b)
+	{
+		std::scoped_lock guard{lock};
+		assert(!segment_head && !budget);
+		budget = b;
+		if constexpr(shared_reclaim)
+			budget->attach(this);
+	}
+
+	/* Has the page map send pool_free() to owner instead of the pool itself,
+	 * for pools that are only ever used through a wrapper; must be set before
+	 * the pool maps its first segment. */
+	void set_page_owner(page_owner *o)
+	{
+		std::scoped_lock guard{lock};
+		assert(!segment_head);
+		owner = o;
+	}
+
+	T *allocate()
+	{
+		memory_chunk<T, alignment> *chunk;
+		bool fresh;
+		bool shed;
+
+		{
+			std::scoped_lock guard{lock};
+			chunk = allocate_chunk(fresh);
+			shed = std::exchange(shed_pending, false);
+		}
+
+		if(shed)
+			budget->shed();
+
+		if(!chunk)
+			return nullptr;
+
+		return reinterpret_cast<T *>(chunk + 1);
+	}
+
+	/* For the paths that have to keep working when the pool can't grow, like
+	 * shedding load: when the pool is out of free chunks, this takes one of
+	 * the tunables.reserved_objects chunks ordinary allocations can't touch,
+	 * without trying to map anything. Freed objects refill the reserve
+	 * before anything else. Returns nullptr only once the reserve is gone
+	 * too and the pool can't grow. */
+	T *allocate_critical()
+	{
+		memory_chunk<T, alignment> *chunk;
+		bool fresh;
+		bool shed;
+
+		{
+			std::scoped_lock guard{lock};
+			if(partial_head || !reserve_head)
+			{
+				chunk = allocate_segment_chunk(fresh);
+			}
+			else
+			{
+				chunk = take_reserved();
+				used_objects++;
+				if(tunables.stats)
+					counters.critical_allocations++;
+			}
+			shed = std::exchange(shed_pending, false);
+		}
+
+		if(shed)
+			budget->shed();
+
+		if(!chunk)
+			return nullptr;
+
+		return reinterpret_cast<T *>(chunk + 1);
+	}
+
+	/* Like allocate(), but the object memory is zeroed. Chunks that were never
+	 * used come straight from mmap and are known to be zero already. */
+	T *allocate_zeroed()
+	{
+		memory_chunk<T, alignment> *chunk;
+		bool fresh;
+		bool shed;
+
+		{
+			std::scoped_lock guard{lock};
+			chunk = allocate_chunk(fresh);
+			shed = std::exchange(shed_pending, false);
+		}
+
+		if(shed)
+			budget->shed();
+
+		if(!chunk)
+			return nullptr;
+
+		auto ptr = reinterpret_cast<T *>(chunk + 1);
+		if(!fresh)
+		{
+			zero_object(ptr);
+#ifdef OBJECT_POOL_SAMPLED_HARDENING
+			/* Zeroing covers the padding after the object, and the canary in it */
+			if(reinterpret_cast<uintptr_t>(chunk->next) & 1)
+				write_tail_canary(chunk);
+#endif
+		}
+
+		return ptr;
+	}
+
+	void free(T *ptr)
+	{
+		auto chunk = ptr_to_chunk(ptr);
+		memory_pool_segment<T, alignment> *dead;
+		//std::cout << "Removing chunk " << chunk << "\n";
+
+#ifdef OBJECT_POOL_SAMPLED_HARDENING
+		if(reinterpret_cast<uintptr_t>(chunk->next) & 1)
+		{
+			free_sampled(chunk);
+			return;
+		}
+#endif
+
+		{
+			std::scoped_lock guard{lock};
+			used_objects--;
+			dead = release_or_reserve(chunk);
+		}
+
+		if(dead)
+			dead->~memory_pool_segment();
+	}
+
+	/* Frees n objects with one trip through the lock. The objects in ptrs
+	 * may get reordered. */
+	void free(T **ptrs, size_t n)
+	{
+		free_batch(ptrs, n);
+	}
+
+	/* Hands ptr to the pool_reclaimer, which frees it in the background,
+	 * batched with others. Waits if the reclaimer is too far behind. */
+	void free_async(T *ptr)
+	{
+		async_pending.fetch_add(1, std::memory_order_relaxed);
+		pool_reclaimer::instance().enqueue(this, ptr, nullptr, sizeof(T));
+	}
+
+	/* Like free_async(), but the reclaimer runs ~T() first. The destructor
+	 * can destroy_async() other objects without waiting. */
+	void destroy_async(T *ptr)
+	{
+		async_pending.fetch_add(1, std::memory_order_relaxed);
+		pool_reclaimer::instance().enqueue(this, ptr, [](void *p) { static_cast<T *>(p)->~T(); }, sizeof(T));
+	}
+
+	void free_deferred(void **ptrs, size_t n) override
+	{
+		free_batch(ptrs, n);
+		async_pending.fetch_sub(n, std::memory_order_release);
+	}
+
+	/* Looks at up to budget segments, starting where the previous call left
+	 * off, and unmaps the empty ones. The lock is only held while walking the
+	 * segments, not while unmapping. Returns true once the walk has reached
+	 * the last segment; the next call starts over from the first one. */
+	bool purge(size_t budget)
+	{
+		size_t freed = 0;
+		return purge_step(budget, freed, std::chrono::steady_clock::now() - tunables.purge_delay);
+	}
+
+	/* Purges in small steps until it's done or time runs out, e.g. from an
+	 * event loop's idle hook. Returns true if it got through all segments. */
+	bool purge(std::chrono::nanoseconds time)
+	{
+		auto deadline = std::chrono::steady_clock::now() + time;
+
+		do
+		{
+			if(purge(purge_batch))
+				return true;
+		} while(std::chrono::steady_clock::now() < deadline);
+
+		return false;
+	}
+
+	/* Returns the pages of partially used segments that hold no live objects
+	 * to the kernel, so that RSS follows the live objects instead of the
+	 * number of segments. They are faulted back in once the segment runs out
+	 * of other free chunks. Returns the number of bytes released. */
+	size_t release_free_pages()
+	{
+		std::scoped_lock guard{lock};
+		size_t released = 0;
+
+		/* Only segments with free chunks can have free pages */
+		for(auto s = partial_head; s; s = s->partial_next)
+			released += s->release_free_pages();
+
+		if(tunables.stats)
+			counters.bytes_released += released;
+		return released;
+	}
+
+	void purge()
+	{
+		{
+			std::scoped_lock guard{lock};
+			purge_cursor = nullptr;
+		}
+
+		purge(SIZE_MAX);
+	}
+
+	/* Called by the pool_registry under memory pressure: drops every empty
+	 * segment and releases the free pages of the rest */
+	size_t reclaim() override
+	{
+		size_t freed = 0;
+		memory_pool_segment<T, alignment> *dead = nullptr;
+
+		{
+			std::scoped_lock guard{lock};
+			purge_cursor = nullptr;
+#ifdef OBJECT_POOL_SAMPLED_HARDENING
+			/* Quarantined chunks pin their segments */
+			dead = drain_quarantine();
+#endif
+		}
+
+		freed += destroy_segments(dead);
+
+		purge_step(SIZE_MAX, freed, std::chrono::steady_clock::time_point::max());
+		return freed + release_free_pages();
+	}
+
+	/* Whether ptr is an object of this pool, allocated or not. Any pointer can
+	 * be asked about, as long as its pool isn't unmapping it at the time. */
+	bool owns(const void *ptr) const
+	{
+		auto entry = pool_pagemap::instance().lookup(ptr);
+		if(entry.pool != owner)
+			return false;
+
+#ifdef OBJECT_POOL_SAMPLED_HARDENING
+		/* Guarded objects are at a fixed spot in their slot */
+		if(!entry.segment)
+		{
+			auto end = guarded.slot_end(ptr);
+			return end && reinterpret_cast<uintptr_t>(ptr) == ((reinterpret_cast<uintptr_t>(end) - sizeof(T)) & -alignment);
+		}
+#endif
+
+		return static_cast<memory_pool_segment<T, alignment> *>(entry.segment)->is_object(ptr);
+	}
+
+	bool free_ptr(void *ptr) override
+	{
+		if(!owns(ptr))
+			return false;
+
+		free(static_cast<T *>(ptr));
+		return true;
+	}
+
+	/* Makes a self-tuning decision over what the pool did since the last
+	 * one, without waiting for tune_interval to pass */
+	void tune_now()
+	{
+		std::scoped_lock guard{lock};
+		tune(true);
+	}
+
+	const memory_pool_tunables &get_tunables() const
+	{
+		return tunables;
+	}
+
+	memory_pool_stats stats()
+	{
+		std::scoped_lock guard{lock};
+		return counters;
+	}
+
+	memory_pool_usage usage()
+	{
+		std::scoped_lock guard{lock};
+		memory_pool_usage u;
+
+		for(auto s = segment_head; s; s = s->next)
+		{
+			u.segments++;
+			u.empty_segments += s->used_objs == 0;
+			u.mapped_bytes += s->segment_size();
+		}
+
+		u.live_objects = used_objects;
+		u.reserved_objects = nr_reserved;
+		return u;
+	}
+};
@@ -0,0 +1,409 @@
+#pragma once
+
+#include <cerrno>
+#include <cstdint>
+#include <fcntl.h>
+#include <linux/magic.h>
+#include <memory>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+#include <type_traits>
+#include <unistd.h>
+
+#include "memory_pool.h"
+
+/* A memory pool living in a memory-mapped file (a regular file, or a file on
+ * hugetlbfs, which rounds segment_size up to its huge page size), so that a
+ * restarted process can map it again and find every object as it was left.
+ *
+ * The file is a sequence of equally sized segments. Segment 0 starts with the
+ * pool header, the other segments leave that space unused so that all of them
+ * share one chunk layout. Nothing in the file is a raw pointer: the free list
+ * and the root object are file offsets, and objects that point to each other
+ * should store offset_of() values too.
+ *
+ * Crash consistency: the free list and counters are only trusted if the pool
+ * was closed cleanly. Otherwise, open() rebuilds them from the per-chunk
+ * state words, which are the only metadata that has to be right. A chunk is
+ * marked allocated only after it has been unlinked from the free list, and
+ * segments only count once their chunks are set up. Crashing at any point
+ * therefore leaves every object either allocated or free, never both. */
+
+struct persistent_pool_header
+{
+	uint64_t magic;
+	uint32_t version;
+	uint32_t clean;
+	uint64_t object_size;
+	uint64_t object_alignment;
+	uint64_t chunk_size;
+	uint64_t segment_size;
+	uint64_t nr_segments;
+	uint64_t free_head;
+	uint64_t used_objects;
+	uint64_t root;
+};
+
+struct persistent_chunk
+{
+	uint64_t next;
+	uint64_t state;
+	/* Note that this is 16-byte aligned */
+};
+
+static constexpr uint64_t persistent_pool_magic = 0x4c4f4f504d454d50;	/* "PMEMPOOL" */
+static constexpr uint32_t persistent_pool_version = 1;
+
+template <typename T>
+class persistent_pool
+{
+	static_assert(std::is_trivially_copyable_v<T>, "persistent objects must survive a restart as plain bytes");
+private:
+	static constexpr size_t alignment = default_object_alignment<T>();
+	static constexpr uint64_t chunk_free = 0x45455246;		/* "FREE" */
+	static constexpr uint64_t chunk_allocated = 0x434f4c41;		/* "ALOC" */
+
+	static constexpr size_t default_segment_size = 2 * 1024 * 1024;
+	static constexpr size_t default_max_size = 64UL * 1024 * 1024 * 1024;
+
+	int fd;
+	/* The whole max_size range is reserved up front, so segments mapped in
+	 * later never move the objects that are already handed out. */
+	unsigned char *base;
+	size_t max_size;
+	size_t segment_size;
+	persistent_pool_header *header;
+	bool was_recovered;
+	std::mutex lock;
+
+	static constexpr size_t size_of_chunk()
+	{
+		return align_up(sizeof(persistent_chunk) + sizeof(T), alignment);
+	}
+
+	static constexpr size_t first_chunk_offset()
+	{
+		return align_up(align_up(sizeof(persistent_pool_header), object_pool_alignment)
+				+ sizeof(persistent_chunk), alignment) - sizeof(persistent_chunk);
+	}
+
+	size_t chunks_per_segment() const
+	{
+		return (segment_size - first_chunk_offset()) / size_of_chunk();
+	}
+
+	persistent_chunk *chunk_at(uint64_t offset) const
+	{
+		return reinterpret_cast<persistent_chunk *>(base + offset);
+	}
+
+	uint64_t chunk_offset(size_t segment, size_t index) const
+	{
+		return segment * segment_size + first_chunk_offset() + index * size_of_chunk();
+	}
+
+	persistent_pool(int fd, void *base, size_t max_size, size_t segment_size) : fd{fd},
+		base{static_cast<unsigned char *>(base)}, max_size{max_size}, segment_size{segment_size},
+		header{static_cast<persistent_pool_header *>(base)}, was_recovered{false}, lock{} {}
+
+	bool map_segments(size_t first, size_t nr)
+	{
+		auto start = base + first * segment_size;
+		auto len = nr * segment_size;
+		return mmap(start, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, first * segment_size) != MAP_FAILED;
+	}
+
+	bool format()
+	{
+		if(ftruncate(fd, segment_size) < 0 || !map_segments(0, 1))
+			return false;
+
+		header->version = persistent_pool_version;
+		header->clean = 0;
+		header->object_size = sizeof(T);
+		header->object_alignment = alignment;
+		header->chunk_size = size_of_chunk();
+		header->segment_size = segment_size;
+		header->nr_segments = 0;
+		header->free_head = 0;
+		header->used_objects = 0;
+		header->root = 0;
+		setup_segment(0);
+		header->free_head = chunk_offset(0, 0);
+		header->nr_segments = 1;
+		/* The magic goes in last, a file without it gets formatted again */
+		__atomic_store_n(&header->magic, persistent_pool_magic, __ATOMIC_RELEASE);
+
+		return true;
+	}
+
+	bool load(size_t file_size)
+	{
+		if(!map_segments(0, 1))
+			return false;
+
+		if(header->magic != persistent_pool_magic || header->version != persistent_pool_version ||
+		   header->object_size != sizeof(T) || header->object_alignment != alignment ||
+		   header->chunk_size != size_of_chunk() || header->segment_size != segment_size)
+		{
+			errno = EPROTO;
+			return false;
+		}
+
+		auto nr_segments = header->nr_segments;
+		if(nr_segments * segment_size > file_size || nr_segments * segment_size > max_size)
+		{
+			errno = EPROTO;
+			return false;
+		}
+
+		if(nr_segments > 1 && !map_segments(1, nr_segments - 1))
+			return false;
+
+		if(!header->clean)
+			recover();
+
+		return true;
+	}
+
+	/* Rebuilds the free list and object count from the chunk states */
+	void recover()
+	{
+		uint64_t free_head = 0;
+		persistent_chunk *tail = nullptr;
+		uint64_t used = 0;
+
+		for(size_t s = 0; s < header->nr_segments; s++)
+		{
+			for(size_t i = 0; i < chunks_per_segment(); i++)
+			{
+				auto off = chunk_offset(s, i);
+				auto c = chunk_at(off);
+
+				if(c->state == chunk_allocated)
+				{
+					used++;
+					continue;
+				}
+
+				c->state = chunk_free;
+				c->next = 0;
+				if(tail)
+					tail->next = off;
+				else
+					free_head = off;
+				tail = c;
+			}
+		}
+
+		header->free_head = free_head;
+		header->used_objects = used;
+		/* A growth that didn't commit may have left a longer file behind */
+		if(ftruncate(fd, header->nr_segments * segment_size) < 0)
+			std::cerr << "persistent_pool: failed to trim file after recovery\n";
+		was_recovered = true;
+	}
+
+	void setup_segment(size_t segment)
+	{
+		auto nr_objs = chunks_per_segment();
+
+		for(size_t i = 0; i < nr_objs; i++)
+		{
+			auto c = chunk_at(chunk_offset(segment, i));
+			c->state = chunk_free;
+			c->next = i + 1 < nr_objs ? chunk_offset(segment, i + 1) : header->free_head;
+		}
+	}
+
+	bool expand_pool()
+	{
+		auto nr_segments = header->nr_segments;
+		if((nr_segments + 1) * segment_size > max_size)
+			return false;
+
+		if(ftruncate(fd, (nr_segments + 1) * segment_size) < 0)
+			return false;
+
+		if(!map_segments(nr_segments, 1))
+			return false;
+
+		setup_segment(nr_segments);
+		header->free_head = chunk_offset(nr_segments, 0);
+		__atomic_store_n(&header->nr_segments, nr_segments + 1, __ATOMIC_RELEASE);
+
+		return true;
+	}
+
+public:
+	/* Opens or creates the pool file at path. Returns nullptr with errno set if
+	 * the file can't be mapped, is in use by another process, or was written
+	 * with a different version or object layout (EPROTO). */
+	static std::unique_ptr<persistent_pool> open(const char *path, size_t segment_size = default_segment_size,
+						     size_t max_size = default_max_size)
+	{
+		segment_size = align_up(segment_size, static_cast<size_t>(PAGE_SIZE));
+		max_size = align_up(max_size, segment_size);
+		if(segment_size < first_chunk_offset() + size_of_chunk())
+		{
+			errno = EINVAL;
+			return nullptr;
+		}
+
+		int fd = ::open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+		if(fd < 0)
+			return nullptr;
+
+		struct stat st;
+		if(flock(fd, LOCK_EX | LOCK_NB) < 0 || fstat(fd, &st) < 0)
+		{
+			auto err = errno;
+			close(fd);
+			errno = err;
+			return nullptr;
+		}
+
+		/* hugetlbfs files can only be sized, and mapped at addresses, in
+		 * whole huge pages */
+		size_t map_alignment = PAGE_SIZE;
+		struct statfs fs;
+		if(fstatfs(fd, &fs) == 0 && fs.f_type == HUGETLBFS_MAGIC)
+		{
+			map_alignment = fs.f_bsize;
+			segment_size = align_up(segment_size, map_alignment);
+			max_size = align_up(max_size, segment_size);
+		}
+
+		/* Reserve enough to align the base, and trim the rest */
+		auto reserve = max_size + map_alignment - PAGE_SIZE;
+		void *region = mmap(nullptr, reserve, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if(region == MAP_FAILED)
+		{
+			auto err = errno;
+			close(fd);
+			errno = err;
+			return nullptr;
+		}
+
+		auto start = reinterpret_cast<uintptr_t>(region);
+		auto aligned = align_up(start, static_cast<uintptr_t>(map_alignment));
+		if(aligned != start)
+			munmap(region, aligned - start);
+		if(aligned + max_size != start + reserve)
+			munmap(reinterpret_cast<void *>(aligned + max_size), start + reserve - aligned - max_size);
+		void *base = reinterpret_cast<void *>(aligned);
+
+		std::unique_ptr<persistent_pool> pool{new persistent_pool{fd, base, max_size, segment_size}};
+
+		/* An empty file, or one we died formatting, gets formatted. Anything
+		 * else has to pass the header checks in load(). */
+		uint64_t magic = 0;
+		if(st.st_size != 0 && pread(fd, &magic, sizeof(magic), 0) < 0)
+			magic = ~0UL;
+		bool formatted = magic != 0;
+
+		if(!(formatted ? pool->load(st.st_size) : pool->format()))
+		{
+			auto err = errno;
+			pool->header = nullptr;
+			pool.reset();
+			errno = err;
+			return nullptr;
+		}
+
+		pool->header->clean = 0;
+		return pool;
+	}
+
+	~persistent_pool()
+	{
+		if(header)
+		{
+			header->clean = 1;
+			msync(base, header->nr_segments * segment_size, MS_SYNC);
+		}
+
+		munmap(base, max_size);
+		close(fd);
+	}
+
+	persistent_pool(const persistent_pool &rhs) = delete;
+	persistent_pool& operator=(const persistent_pool &rhs) = delete;
+
+	T *allocate()
+	{
+		std::scoped_lock guard{lock};
+
+		while(!header->free_head)
+		{
+			if(!expand_pool())
+				return nullptr;
+		}
+
+		auto off = header->free_head;
+		auto c = chunk_at(off);
+		assert(c->state == chunk_free);
+
+		header->free_head = c->next;
+		c->next = 0;
+		c->state = chunk_allocated;
+		header->used_objects++;
+
+		return reinterpret_cast<T *>(c + 1);
+	}
+
+	void free(T *ptr)
+	{
+		auto c = reinterpret_cast<persistent_chunk *>(ptr) - 1;
+		std::scoped_lock guard{lock};
+
+		assert(c->state == chunk_allocated);
+		c->state = chunk_free;
+		c->next = header->free_head;
+		header->free_head = reinterpret_cast<unsigned char *>(c) - base;
+		header->used_objects--;
+	}
+
+	/* Offsets are what objects should store to refer to each other, they stay
+	 * valid across restarts while pointers don't. 0 is never a valid object. */
+	uint64_t offset_of(const T *ptr) const
+	{
+		return ptr ? reinterpret_cast<const unsigned char *>(ptr) - base : 0;
+	}
+
+	T *at(uint64_t offset) const
+	{
+		return offset ? reinterpret_cast<T *>(base + offset) : nullptr;
+	}
+
+	/* The root object is how a restarted process finds its way back in */
+	T *root() const
+	{
+		return at(header->root);
+	}
+
+	void set_root(T *ptr)
+	{
+		__atomic_store_n(&header->root, offset_of(ptr), __ATOMIC_RELEASE);
+	}
+
+	/* True if the pool wasn't closed cleanly and had to be rebuilt on open */
+	bool recovered() const
+	{
+		return was_recovered;
+	}
+
+	size_t used_objects() const
+	{
+		return header->used_objects;
+	}
+
+	/* The page cache keeps the pool across process crashes; this makes it
+	 * survive machine crashes too, up to this point. */
+	int sync()
+	{
+		std::scoped_lock guard{lock};
+		return msync(base, header->nr_segments * segment_size, MS_SYNC);
+	}
+};
@@ -0,0 +1,200 @@
+#include "memory_pool.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <linux/perf_event.h>
+#include <random>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+/* One row of the policy matrix: the workloads below against memory_pool as
+ * configured by the policy macros this was compiled with. make matrix builds
+ * it once for every combination and puts the rows together. */
+
+class object
+{
+private:
+	unsigned long data[8];
+};
+
+static constexpr size_t batch_size = 64;
+
+/* Counts cache misses of this thread, where perf events are allowed */
+class miss_counter
+{
+private:
+	int fd;
+public:
+	miss_counter()
+	{
+		perf_event_attr attr;
+		std::memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = PERF_TYPE_HARDWARE;
+		attr.config = PERF_COUNT_HW_CACHE_MISSES;
+		attr.disabled = 1;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+	}
+
+	~miss_counter()
+	{
+		if(fd >= 0)
+			close(fd);
+	}
+
+	miss_counter(const miss_counter &rhs) = delete;
+	miss_counter& operator=(const miss_counter &rhs) = delete;
+
+	void start()
+	{
+		if(fd < 0)
+			return;
+		ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+		ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+	}
+
+	/* Returns -1 if there's no counter */
+	long long stop()
+	{
+		long long count;
+		if(fd < 0)
+			return -1;
+		ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+		return read(fd, &count, sizeof(count)) == sizeof(count) ? count : -1;
+	}
+};
+
+/* Allocates a batch and frees it again: the pool's fast paths only */
+static void batch_churn(memory_pool<object> &pool, size_t ops)
+{
+	object *batch[batch_size];
+
+	for(size_t done = 0; done < ops; done += batch_size)
+	{
+		for(auto &p : batch)
+		{
+			p = pool.allocate();
+			std::memset(static_cast<void *>(p), 0, sizeof(object));
+		}
+		for(auto p : batch)
+			pool.free(p);
+	}
+}
+
+/* Replaces random objects of a live set bigger than the caches and writes
+ * to the new ones, which is where the reuse order shows */
+static void random_churn(memory_pool<object> &pool, size_t ops)
+{
+	std::vector<object *> live(1 << 18);
+	std::mt19937_64 rng{42};
+
+	for(auto &o : live)
+		o = pool.allocate();
+
+	for(size_t i = 0; i < ops; i++)
+	{
+		auto &o = live[rng() % live.size()];
+		pool.free(o);
+		o = pool.allocate();
+		std::memset(static_cast<void *>(o), 0, sizeof(object));
+	}
+
+	for(auto o : live)
+		pool.free(o);
+}
+
+/* Fills a segment and empties it again, over and over, which is where
+ * deferred unmapping shows */
+static void segment_churn(memory_pool<object> &pool, size_t ops)
+{
+	auto per_segment = memory_pool_segment<object>::number_of_objects(pool.get_tunables().segment_size);
+	std::vector<object *> objs(per_segment + 1);
+
+	for(size_t done = 0; done < ops; done += objs.size())
+	{
+		for(auto &o : objs)
+			o = pool.allocate();
+		for(auto o : objs)
+			pool.free(o);
+	}
+}
+
+static const char *policy_name()
+{
+	return
+#ifdef OBJECT_POOL_ALLOCATE_WARM_CACHE
+		"lifo"
+#else
+		"fifo"
+#endif
+#ifdef OBJECT_CANARY
+		"+canary"
+#endif
+#ifdef OBJECT_POOL_DEFER_UNMAP
+		"+defer-unmap"
+#endif
+#ifndef OBJECT_POOL_SAMPLED_HARDENING
+		"-sampling"
+#endif
+		;
+}
+
+/* Runs the workload in a child process, so that maxrss is its own */
+static void run(const char *name, void (*workload)(memory_pool<object> &, size_t), size_t ops)
+{
+	std::fflush(stdout);
+	pid_t pid = fork();
+	if(pid < 0)
+	{
+		std::perror("fork");
+		return;
+	}
+
+	if(pid)
+	{
+		waitpid(pid, nullptr, 0);
+		return;
+	}
+
+	memory_pool<object> pool;
+	miss_counter misses;
+
+	misses.start();
+	auto start = std::chrono::steady_clock::now();
+	workload(pool, ops);
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+	auto count = misses.stop();
+
+	char miss_rate[32] = "n/a";
+	if(count >= 0)
+		std::snprintf(miss_rate, sizeof(miss_rate), "%.3f", static_cast<double>(count) / ops);
+
+	rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+
+	std::printf("%-24s %-16s %12.2f %12s %12ld\n", policy_name(), name, ops / elapsed.count() / 1e6,
+		    miss_rate, usage.ru_maxrss);
+	std::fflush(stdout);
+	_exit(0);
+}
+
+int main(int argc, char **argv)
+{
+	size_t ops = argc > 1 ? std::strtoul(argv[1], nullptr, 0) : 1 << 22;
+
+	if(argc > 2 && !std::strcmp(argv[2], "header"))
+		std::printf("%-24s %-16s %12s %12s %12s\n", "policy", "workload", "Mops/s", "misses/op", "maxrss KiB");
+
+	run("batch churn", batch_churn, ops);
+	run("random churn", random_churn, ops);
+	run("segment churn", segment_churn, ops);
+	return 0;
+}
@@ -0,0 +1,125 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <mutex>
+#include <vector>
+
+#include "pool_registry.h"
+
+/* A memory budget for one pool, or shared by a group of pools when it is
+ * another budget's parent. Pools charge it for every segment they map.
+ *
+ * Past the soft limit, the pools charged to the budget (at any level) get
+ * asked to give back whatever they can. The hard limit is never exceeded:
+ * expand_pool() fails instead and allocate() returns nullptr.
+ *
+ * The budget is only touched when segments come and go, and pools reserve
+ * in batches of several segments, so pools sharing a group don't bounce its
+ * counter between CPUs. */
+class pool_budget
+{
+private:
+	std::atomic<size_t> used;
+	const size_t soft_limit, hard_limit;
+	pool_budget *parent;
+	std::mutex pools_lock;
+	std::vector<reclaimable_pool *> pools;
+	std::atomic<bool> shedding;
+
+	bool reserve_local(size_t bytes)
+	{
+		auto old = used.fetch_add(bytes, std::memory_order_relaxed);
+		if(old + bytes > hard_limit)
+		{
+			used.fetch_sub(bytes, std::memory_order_relaxed);
+			return false;
+		}
+
+		return true;
+	}
+
+public:
+	pool_budget(size_t soft_limit, size_t hard_limit, pool_budget *parent = nullptr) : used{0},
+		soft_limit{soft_limit}, hard_limit{hard_limit}, parent{parent}, pools_lock{}, pools{}, shedding{false} {}
+
+	pool_budget(const pool_budget &rhs) = delete;
+	pool_budget& operator=(const pool_budget &rhs) = delete;
+
+	/* Reserves bytes here and in every parent, or nowhere if that would take
+	 * any of them past its hard limit */
+	bool reserve(size_t bytes)
+	{
+		if(!reserve_local(bytes))
+			return false;
+
+		if(parent && !parent->reserve(bytes))
+		{
+			used.fetch_sub(bytes, std::memory_order_relaxed);
+			return false;
+		}
+
+		return true;
+	}
+
+	void release(size_t bytes)
+	{
+		used.fetch_sub(bytes, std::memory_order_relaxed);
+		if(parent)
+			parent->release(bytes);
+	}
+
+	bool over_soft_limit() const
+	{
+		return used.load(std::memory_order_relaxed) > soft_limit ||
+		       (parent && parent->over_soft_limit());
+	}
+
+	size_t usage() const
+	{
+		return used.load(std::memory_order_relaxed);
+	}
+
+	void attach(reclaimable_pool *pool)
+	{
+		{
+			std::scoped_lock guard{pools_lock};
+			pools.push_back(pool);
+		}
+
+		if(parent)
+			parent->attach(pool);
+	}
+
+	void detach(reclaimable_pool *pool)
+	{
+		{
+			std::scoped_lock guard{pools_lock};
+			pools.erase(std::remove(pools.begin(), pools.end(), pool), pools.end());
+		}
+
+		if(parent)
+			parent->detach(pool);
+	}
+
+	/* Makes every pool under this budget, and under the parents that are over
+	 * their soft limit, give back what it can. Callers must not hold any pool
+	 * lock. Concurrent calls collapse into one. */
+	void shed()
+	{
+		if(parent && parent->over_soft_limit())
+			parent->shed();
+
+		if(used.load(std::memory_order_relaxed) <= soft_limit || shedding.exchange(true, std::memory_order_acquire))
+			return;
+
+		{
+			std::scoped_lock guard{pools_lock};
+			for(auto p : pools)
+				p->reclaim();
+		}
+
+		shedding.store(false, std::memory_order_release);
+	}
+};
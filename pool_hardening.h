@@ -0,0 +1,144 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <sys/mman.h>
+#include <sys/user.h>
+
+/* Support for memory_pool's sampled hardening: a small fraction of
+ * allocations is checked for overflows and use after free, so that it can
+ * stay on in production. See OBJECT_POOL_SAMPLED_HARDENING. */
+
+/* Freed sampled objects are filled with this until they are really freed */
+static constexpr unsigned char sample_poison = 0xdb;
+
+[[noreturn]] static inline void report_pool_corruption(const char *what, const void *ptr)
+{
+	std::fprintf(stderr, "memory_pool: %s (object %p)\n", what, ptr);
+	std::abort();
+}
+
+/* GWP-ASan style guarded allocations. Every slot is a few pages followed by
+ * an inaccessible guard page, and only the slots in use are accessible at
+ * all: the object is put at the end of its slot, so running off its end
+ * faults on the guard page, and touching it after it has been freed faults
+ * too. Slots are handed out round robin, so a freed slot stays inaccessible
+ * for as long as possible. */
+class guarded_slots
+{
+private:
+	unsigned char *region;
+	size_t data_size, nr_slots;
+	uint64_t in_use;
+	size_t next;
+
+	size_t slot_size() const
+	{
+		return data_size + PAGE_SIZE;
+	}
+
+	size_t slot_of(const void *ptr) const
+	{
+		auto p = static_cast<const unsigned char *>(ptr);
+		if(!region || p < region || p >= region + size())
+			return SIZE_MAX;
+
+		size_t offset = p - region;
+		if(offset % slot_size() >= data_size)
+			return SIZE_MAX;
+		return offset / slot_size();
+	}
+
+public:
+	static constexpr size_t max_slots = 64;
+
+	guarded_slots() : region{nullptr}, data_size{0}, nr_slots{0}, in_use{0}, next{0} {}
+
+	~guarded_slots()
+	{
+		if(region)
+			munmap(region, size());
+	}
+
+	guarded_slots(const guarded_slots &rhs) = delete;
+	guarded_slots& operator=(const guarded_slots &rhs) = delete;
+
+	/* Reserves the slots, each big enough for bytes */
+	bool map(size_t bytes, size_t slots)
+	{
+		data_size = (bytes + PAGE_SIZE - 1) & PAGE_MASK;
+		nr_slots = slots < max_slots ? slots : max_slots;
+
+		void *r = mmap(nullptr, size(), PROT_NONE, MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
+		if(r == MAP_FAILED)
+		{
+			nr_slots = 0;
+			return false;
+		}
+
+		region = static_cast<unsigned char *>(r);
+		return true;
+	}
+
+	bool mapped() const
+	{
+		return region != nullptr;
+	}
+
+	unsigned char *base() const
+	{
+		return region;
+	}
+
+	size_t size() const
+	{
+		return nr_slots * slot_size();
+	}
+
+	/* Makes a free slot accessible and returns the end of its data, where
+	 * the guard page starts, or nullptr if every slot is taken. The data is
+	 * zero. */
+	unsigned char *take()
+	{
+		for(size_t i = 0; i < nr_slots; i++)
+		{
+			auto slot = (next + i) % nr_slots;
+			if(in_use & (1UL << slot))
+				continue;
+
+			auto data = region + slot * slot_size();
+			if(mprotect(data, data_size, PROT_READ | PROT_WRITE) < 0)
+				return nullptr;
+
+			in_use |= 1UL << slot;
+			next = slot + 1;
+			return data + data_size;
+		}
+
+		return nullptr;
+	}
+
+	/* The end of the data of the taken slot ptr points into, or nullptr */
+	unsigned char *slot_end(const void *ptr) const
+	{
+		auto slot = slot_of(ptr);
+		if(slot == SIZE_MAX || !(in_use & (1UL << slot)))
+			return nullptr;
+		return region + slot * slot_size() + data_size;
+	}
+
+	/* Drops the slot's pages and makes it inaccessible again */
+	bool give_back(const void *ptr)
+	{
+		auto slot = slot_of(ptr);
+		if(slot == SIZE_MAX || !(in_use & (1UL << slot)))
+			return false;
+
+		auto data = region + slot * slot_size();
+		madvise(data, data_size, MADV_DONTNEED);
+		mprotect(data, data_size, PROT_NONE);
+		in_use &= ~(1UL << slot);
+		return true;
+	}
+};
@@ -0,0 +1,233 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <linux/futex.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/* Lock policies for memory_pool. The allocate/free critical sections are a few
+ * dozen instructions long, so sleeping in the kernel the moment the lock is
+ * contended, like std::mutex does, costs far more than the section itself.
+ * All of these are BasicLockable and work with std::scoped_lock. */
+
+static inline void cpu_relax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__)
+	asm volatile("yield" ::: "memory");
+#endif
+}
+
+/* Waiters that have spun for this long give up the CPU between checks, the
+ * holder might be preempted and spinning would only keep it from running */
+static constexpr unsigned int spin_before_yield = 4096;
+
+class spin_waiter
+{
+private:
+	unsigned int spins;
+public:
+	spin_waiter() : spins{0} {}
+
+	void wait(unsigned int iterations = 1)
+	{
+		if(spins >= spin_before_yield)
+		{
+			sched_yield();
+			return;
+		}
+
+		for(unsigned int i = 0; i < iterations; i++)
+			cpu_relax();
+		spins += iterations;
+	}
+};
+
+/* Test-and-test-and-set with bounded exponential backoff */
+class ttas_lock
+{
+private:
+	static constexpr unsigned int max_backoff = 1024;
+	std::atomic<bool> locked;
+public:
+	ttas_lock() : locked{false} {}
+
+	void lock()
+	{
+		unsigned int backoff = 1;
+		spin_waiter waiter;
+
+		while(true)
+		{
+			if(!locked.load(std::memory_order_relaxed) &&
+			   !locked.exchange(true, std::memory_order_acquire))
+				return;
+
+			waiter.wait(backoff);
+			if(backoff < max_backoff)
+				backoff <<= 1;
+		}
+	}
+
+	void unlock()
+	{
+		locked.store(false, std::memory_order_release);
+	}
+};
+
+/* FIFO ticket lock; waiters back off in proportion to their place in the queue */
+class ticket_lock
+{
+private:
+	std::atomic<uint32_t> next_ticket;
+	std::atomic<uint32_t> now_serving;
+public:
+	ticket_lock() : next_ticket{0}, now_serving{0} {}
+
+	void lock()
+	{
+		auto ticket = next_ticket.fetch_add(1, std::memory_order_relaxed);
+		spin_waiter waiter;
+
+		while(true)
+		{
+			auto serving = now_serving.load(std::memory_order_acquire);
+			if(serving == ticket)
+				return;
+
+			waiter.wait((ticket - serving) * 32);
+		}
+	}
+
+	void unlock()
+	{
+		now_serving.store(now_serving.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+	}
+};
+
+/* MCS queue lock: every waiter spins on its own cache line, so handing the
+ * lock over touches just the next waiter's line. Queue nodes are per-thread;
+ * a thread may hold up to max_nesting MCS locks at once, or it aborts, and
+ * has to release them in reverse order, as std::scoped_lock does. */
+class mcs_lock
+{
+private:
+	struct alignas(64) qnode
+	{
+		std::atomic<qnode *> next;
+		std::atomic<bool> locked;
+	};
+
+	static constexpr unsigned int max_nesting = 8;
+	static inline thread_local qnode nodes[max_nesting];
+	static inline thread_local unsigned int depth = 0;
+
+	std::atomic<qnode *> tail;
+	/* Only touched by the lock holder */
+	qnode *holder;
+public:
+	mcs_lock() : tail{nullptr}, holder{nullptr} {}
+
+	void lock()
+	{
+		/* Going on would run past the node array, even in release builds */
+		if(depth == max_nesting)
+		{
+			std::fprintf(stderr, "memory_pool: more than %u nested mcs_locks\n", max_nesting);
+			std::abort();
+		}
+
+		auto node = &nodes[depth++];
+		node->next.store(nullptr, std::memory_order_relaxed);
+		node->locked.store(true, std::memory_order_relaxed);
+
+		auto prev = tail.exchange(node, std::memory_order_acq_rel);
+		if(prev)
+		{
+			spin_waiter waiter;
+			prev->next.store(node, std::memory_order_release);
+			while(node->locked.load(std::memory_order_acquire))
+				waiter.wait();
+		}
+
+		holder = node;
+	}
+
+	void unlock()
+	{
+		auto node = holder;
+		auto next = node->next.load(std::memory_order_acquire);
+
+		if(!next)
+		{
+			auto expected = node;
+			if(tail.compare_exchange_strong(expected, nullptr, std::memory_order_release,
+							std::memory_order_relaxed))
+			{
+				depth--;
+				return;
+			}
+
+			/* Someone is queueing up behind us, wait for them to link in */
+			spin_waiter waiter;
+			while(!(next = node->next.load(std::memory_order_acquire)))
+				waiter.wait();
+		}
+
+		next->locked.store(false, std::memory_order_release);
+		depth--;
+	}
+};
+
+/* Spins for a while, then sleeps on a futex. The state is 0 when unlocked,
+ * 1 when locked and 2 when locked with (possible) sleepers, so an uncontended
+ * unlock never makes a syscall. */
+class adaptive_futex_lock
+{
+private:
+	static constexpr unsigned int spin_count = 128;
+	std::atomic<uint32_t> state;
+
+	static void futex(std::atomic<uint32_t> *addr, int op, uint32_t val)
+	{
+		syscall(SYS_futex, reinterpret_cast<uint32_t *>(addr), op | FUTEX_PRIVATE_FLAG, val, nullptr, nullptr, 0);
+	}
+public:
+	adaptive_futex_lock() : state{0} {}
+
+	void lock()
+	{
+		uint32_t expected = 0;
+
+		for(unsigned int i = 0; i < spin_count; i++)
+		{
+			expected = 0;
+			if(state.compare_exchange_weak(expected, 1, std::memory_order_acquire, std::memory_order_relaxed))
+				return;
+			cpu_relax();
+		}
+
+		/* From here on we may be sleeping, so always leave the lock marked contended */
+		while(state.exchange(2, std::memory_order_acquire) != 0)
+			futex(&state, FUTEX_WAIT, 2);
+	}
+
+	void unlock()
+	{
+		if(state.exchange(0, std::memory_order_release) == 2)
+			futex(&state, FUTEX_WAKE, 1);
+	}
+};
+
+/* For pools that are already serialized by something else */
+class null_lock
+{
+public:
+	void lock() {}
+	void unlock() {}
+};
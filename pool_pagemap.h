@@ -0,0 +1,172 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <new>
+#include <sys/mman.h>
+#include <sys/user.h>
+
+/* A pool that can take back a pointer without knowing its type, so that
+ * pool_free() can route it */
+class page_owner
+{
+public:
+	/* Returns false, without freeing anything, if ptr isn't one of its objects */
+	virtual bool free_ptr(void *ptr) = 0;
+protected:
+	~page_owner() = default;
+};
+
+struct pagemap_entry
+{
+	page_owner *pool;
+	/* The segment the page belongs to, as the pool sees it */
+	void *segment;
+};
+
+/* Maps every page that belongs to a pool to its pool and segment, like
+ * tcmalloc's pagemap: a three level radix tree over the page number of a
+ * 48-bit address. Lookups are three dependent loads and take no locks; nodes
+ * are mmap'd the first time a page under them is set and never go away, so
+ * a lookup racing with an update sees either the old or the new entry.
+ *
+ * Pools set their pages when they map a segment and clear them before they
+ * unmap it, both on their slow paths. */
+class pool_pagemap
+{
+private:
+	static constexpr unsigned int address_bits = 48;
+	static constexpr unsigned int level_bits = 12;
+	static constexpr size_t level_size = 1UL << level_bits;
+	static_assert(address_bits - PAGE_SHIFT == 3 * level_bits, "the three levels have to cover every page");
+
+	struct leaf
+	{
+		struct
+		{
+			std::atomic<page_owner *> pool;
+			std::atomic<void *> segment;
+		} entries[level_size];
+	};
+
+	struct interior
+	{
+		std::atomic<leaf *> leaves[level_size];
+	};
+
+	std::atomic<interior *> root[level_size];
+	/* Serializes updates; lookups don't take it */
+	std::mutex lock;
+
+	pool_pagemap() : root{}, lock{} {}
+
+	template <typename Node>
+	static Node *new_node()
+	{
+		void *mem = mmap(nullptr, sizeof(Node), PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+		if(mem == MAP_FAILED)
+			return nullptr;
+		return new (mem) Node{};
+	}
+
+	/* Returns the leaf for the page, creating it if create is set */
+	leaf *leaf_for(uintptr_t page, bool create)
+	{
+		auto &mid_slot = root[page >> (2 * level_bits)];
+		auto mid = mid_slot.load(std::memory_order_acquire);
+		if(!mid)
+		{
+			if(!create || !(mid = new_node<interior>()))
+				return nullptr;
+			mid_slot.store(mid, std::memory_order_release);
+		}
+
+		auto &leaf_slot = mid->leaves[(page >> level_bits) & (level_size - 1)];
+		auto l = leaf_slot.load(std::memory_order_acquire);
+		if(!l)
+		{
+			if(!create || !(l = new_node<leaf>()))
+				return nullptr;
+			leaf_slot.store(l, std::memory_order_release);
+		}
+
+		return l;
+	}
+
+	bool update(const void *start, size_t len, page_owner *pool, void *segment)
+	{
+		std::scoped_lock guard{lock};
+		auto first = reinterpret_cast<uintptr_t>(start) >> PAGE_SHIFT;
+		auto last = (reinterpret_cast<uintptr_t>(start) + len - 1) >> PAGE_SHIFT;
+
+		if(last >> (address_bits - PAGE_SHIFT))
+			return false;
+
+		for(auto page = first; page <= last; page++)
+		{
+			auto l = leaf_for(page, pool != nullptr);
+			if(!l)
+			{
+				if(pool)
+					return false;
+				continue;
+			}
+
+			auto &e = l->entries[page & (level_size - 1)];
+			e.pool.store(pool, std::memory_order_relaxed);
+			e.segment.store(segment, std::memory_order_relaxed);
+		}
+
+		return true;
+	}
+
+public:
+	static pool_pagemap &instance()
+	{
+		static pool_pagemap pagemap;
+		return pagemap;
+	}
+
+	pool_pagemap(const pool_pagemap &rhs) = delete;
+	pool_pagemap& operator=(const pool_pagemap &rhs) = delete;
+
+	/* Returns false if a node couldn't be allocated; the range may then be
+	 * partly set, and should be cleared. */
+	bool set(const void *start, size_t len, page_owner *pool, void *segment)
+	{
+		return update(start, len, pool, segment);
+	}
+
+	void clear(const void *start, size_t len)
+	{
+		update(start, len, nullptr, nullptr);
+	}
+
+	/* Returns a null pool for pages that no pool owns */
+	pagemap_entry lookup(const void *ptr) const
+	{
+		auto page = reinterpret_cast<uintptr_t>(ptr) >> PAGE_SHIFT;
+		if(page >> (address_bits - PAGE_SHIFT))
+			return {nullptr, nullptr};
+
+		auto mid = root[page >> (2 * level_bits)].load(std::memory_order_acquire);
+		if(!mid)
+			return {nullptr, nullptr};
+
+		auto l = mid->leaves[(page >> level_bits) & (level_size - 1)].load(std::memory_order_acquire);
+		if(!l)
+			return {nullptr, nullptr};
+
+		auto &e = l->entries[page & (level_size - 1)];
+		return {e.pool.load(std::memory_order_relaxed), e.segment.load(std::memory_order_relaxed)};
+	}
+};
+
+/* Frees ptr into whichever pool it came from. Returns false, and leaves ptr
+ * alone, if it isn't an object of any pool. */
+static inline bool pool_free(void *ptr)
+{
+	auto owner = pool_pagemap::instance().lookup(ptr).pool;
+	return owner && owner->free_ptr(ptr);
+}
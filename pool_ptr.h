@@ -0,0 +1,182 @@
+#pragma once
+
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+#include "memory_pool.h"
+#include "pool_pagemap.h"
+
+/* Smart pointers for objects in memory pools. The deleter finds the pool of
+ * an object through the page map, like pool_free(), so a pool_unique_ptr is
+ * as big as a plain pointer, and a pool_shared_ptr keeps its reference count
+ * next to the object in the same chunk instead of in a control block. */
+
+/* Destroys the object and frees it into whichever pool it came from */
+template <typename T>
+struct pool_delete
+{
+	void operator()(T *ptr) const
+	{
+		ptr->~T();
+		[[maybe_unused]] bool freed = pool_free(ptr);
+		assert(freed);
+	}
+};
+
+template <typename T>
+using pool_unique_ptr = std::unique_ptr<T, pool_delete<T>>;
+
+/* Constructs a T in pool, or returns an empty pointer if the pool is out of memory */
+template <typename T, size_t alignment, typename Lock, typename... Args>
+pool_unique_ptr<T> make_pool_unique(memory_pool<T, alignment, Lock> &pool, Args&&... args)
+{
+	auto mem = pool.allocate();
+	if(!mem)
+		return nullptr;
+	return pool_unique_ptr<T>{new (mem) T(std::forward<Args>(args)...)};
+}
+
+/* What a pool behind pool_shared_ptr holds: the object and its reference
+ * count. Atomic is false for objects that never leave their thread. */
+template <typename T, bool Atomic = true>
+struct pool_shared_node
+{
+	std::conditional_t<Atomic, std::atomic<size_t>, size_t> refs;
+	T value;
+
+	template <typename... Args>
+	pool_shared_node(Args&&... args) : refs{1}, value(std::forward<Args>(args)...) {}
+};
+
+template <typename T, bool Atomic = true, size_t alignment = default_object_alignment<pool_shared_node<T, Atomic>>(),
+	  typename Lock = std::mutex>
+using shared_object_pool = memory_pool<pool_shared_node<T, Atomic>, alignment, Lock>;
+
+template <typename T, bool Atomic = true>
+class pool_shared_ptr
+{
+private:
+	using node = pool_shared_node<T, Atomic>;
+	node *n;
+
+	void acquire()
+	{
+		if(!n)
+			return;
+		if constexpr(Atomic)
+			n->refs.fetch_add(1, std::memory_order_relaxed);
+		else
+			n->refs++;
+	}
+
+	void release()
+	{
+		if(!n)
+			return;
+
+		bool last;
+		if constexpr(Atomic)
+			last = n->refs.fetch_sub(1, std::memory_order_acq_rel) == 1;
+		else
+			last = --n->refs == 0;
+
+		if(last)
+			pool_delete<node>{}(n);
+	}
+
+public:
+	pool_shared_ptr() : n{nullptr} {}
+	pool_shared_ptr(std::nullptr_t) : n{nullptr} {}
+	/* Takes over a node with a count of one, see make_pool_shared() */
+	explicit pool_shared_ptr(node *n) : n{n} {}
+
+	pool_shared_ptr(const pool_shared_ptr &rhs) : n{rhs.n}
+	{
+		acquire();
+	}
+
+	pool_shared_ptr(pool_shared_ptr &&rhs) : n{std::exchange(rhs.n, nullptr)} {}
+
+	pool_shared_ptr& operator=(const pool_shared_ptr &rhs)
+	{
+		pool_shared_ptr{rhs}.swap(*this);
+		return *this;
+	}
+
+	pool_shared_ptr& operator=(pool_shared_ptr &&rhs)
+	{
+		pool_shared_ptr{std::move(rhs)}.swap(*this);
+		return *this;
+	}
+
+	~pool_shared_ptr()
+	{
+		release();
+	}
+
+	void swap(pool_shared_ptr &rhs)
+	{
+		std::swap(n, rhs.n);
+	}
+
+	void reset()
+	{
+		release();
+		n = nullptr;
+	}
+
+	T *get() const
+	{
+		return n ? &n->value : nullptr;
+	}
+
+	T &operator*() const
+	{
+		return n->value;
+	}
+
+	T *operator->() const
+	{
+		return &n->value;
+	}
+
+	explicit operator bool() const
+	{
+		return n != nullptr;
+	}
+
+	size_t use_count() const
+	{
+		if(!n)
+			return 0;
+		if constexpr(Atomic)
+			return n->refs.load(std::memory_order_relaxed);
+		else
+			return n->refs;
+	}
+
+	bool operator==(const pool_shared_ptr &rhs) const
+	{
+		return n == rhs.n;
+	}
+
+	bool operator!=(const pool_shared_ptr &rhs) const
+	{
+		return n != rhs.n;
+	}
+};
+
+/* Constructs a T in pool, or returns an empty pointer if the pool is out of memory */
+template <typename T, bool Atomic, size_t alignment, typename Lock, typename... Args>
+pool_shared_ptr<T, Atomic> make_pool_shared(memory_pool<pool_shared_node<T, Atomic>, alignment, Lock> &pool, Args&&... args)
+{
+	auto mem = pool.allocate();
+	if(!mem)
+		return nullptr;
+	return pool_shared_ptr<T, Atomic>{new (mem) pool_shared_node<T, Atomic>(std::forward<Args>(args)...)};
+}
@@ -0,0 +1,192 @@
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <new>
+#include <pthread.h>
+#include <thread>
+#include <vector>
+
+/* A pool that can take back a batch of objects at once, for the
+ * pool_reclaimer */
+class async_freeable
+{
+public:
+	virtual void free_deferred(void **ptrs, size_t n) = 0;
+protected:
+	~async_freeable() = default;
+};
+
+/* Background thread behind memory_pool::free_async() and destroy_async():
+ * it runs the destructors of the objects handed to it and gives them back
+ * to their pools in batches, one lock round trip per pool and batch, so
+ * that tearing down a big object graph doesn't land on the thread that
+ * dropped it.
+ *
+ * Queued objects are bounded by limit bytes. Past that, callers wait for
+ * the reclaimer to catch up, except destructors running on the reclaimer
+ * itself, which can queue the rest of a graph.
+ *
+ * A forked child starts with an empty queue and no thread; one gets started
+ * the first time the child queues something. Whatever was queued in the
+ * parent at the time of the fork is left alone in the child. */
+class pool_reclaimer
+{
+private:
+	struct entry
+	{
+		async_freeable *pool;
+		void *ptr;
+		/* Runs the destructor, or nullptr to just free */
+		void (*destroy)(void *);
+		size_t bytes;
+	};
+
+	mutable std::mutex lock;
+	/* work wakes the reclaimer, done wakes callers waiting for room or a drain */
+	std::condition_variable work, done;
+	std::vector<entry> queue;
+	size_t queued_bytes, limit;
+	/* Batches handed out so far, and the ones the reclaimer is finished with */
+	size_t started, finished;
+	bool stopping;
+	std::thread worker;
+
+	static constexpr size_t default_limit = 64 * 1024 * 1024;
+
+	pool_reclaimer() : lock{}, work{}, done{}, queue{}, queued_bytes{0}, limit{default_limit},
+		started{0}, finished{0}, stopping{false}, worker{}
+	{
+		/* Hold the lock over fork(), so the child gets the queue in one piece */
+		pthread_atfork([]() { instance().lock.lock(); }, []() { instance().lock.unlock(); },
+			       []() { instance().reset_after_fork(); });
+	}
+
+	/* Only the thread that forked lives on in the child. The worker didn't,
+	 * so its std::thread is still joinable but must not be joined, and the
+	 * condition variables may have had waiters that don't exist anymore. */
+	void reset_after_fork()
+	{
+		new (&worker) std::thread{};
+		new (&work) std::condition_variable{};
+		new (&done) std::condition_variable{};
+		queue.clear();
+		queued_bytes = 0;
+		started = finished = 0;
+		lock.unlock();
+	}
+
+	~pool_reclaimer()
+	{
+		{
+			std::scoped_lock guard{lock};
+			stopping = true;
+		}
+
+		work.notify_one();
+		if(worker.joinable())
+			worker.join();
+	}
+
+	void run()
+	{
+		std::vector<entry> batch;
+		std::vector<void *> ptrs;
+		std::unique_lock guard{lock};
+
+		while(true)
+		{
+			work.wait(guard, [this]() { return stopping || !queue.empty(); });
+			if(queue.empty())
+				break;
+
+			batch.swap(queue);
+			started++;
+			guard.unlock();
+
+			/* Destructors may queue more objects, which go into the next batch */
+			for(auto &e : batch)
+			{
+				if(e.destroy)
+					e.destroy(e.ptr);
+			}
+
+			std::sort(batch.begin(), batch.end(), [](auto &a, auto &b) { return a.pool < b.pool; });
+			size_t bytes = 0;
+			for(size_t i = 0; i < batch.size();)
+			{
+				auto pool = batch[i].pool;
+				ptrs.clear();
+				for(; i < batch.size() && batch[i].pool == pool; i++)
+				{
+					ptrs.push_back(batch[i].ptr);
+					bytes += batch[i].bytes;
+				}
+
+				pool->free_deferred(ptrs.data(), ptrs.size());
+			}
+
+			batch.clear();
+			guard.lock();
+			queued_bytes -= bytes;
+			finished++;
+			done.notify_all();
+		}
+	}
+
+public:
+	static pool_reclaimer &instance()
+	{
+		static pool_reclaimer reclaimer;
+		return reclaimer;
+	}
+
+	pool_reclaimer(const pool_reclaimer &rhs) = delete;
+	pool_reclaimer& operator=(const pool_reclaimer &rhs) = delete;
+
+	/* Bytes of queued objects past which callers wait */
+	void set_limit(size_t bytes)
+	{
+		std::scoped_lock guard{lock};
+		limit = bytes;
+		done.notify_all();
+	}
+
+	size_t queued() const
+	{
+		std::scoped_lock guard{lock};
+		return queued_bytes;
+	}
+
+	/* Queues ptr for pool. An object bigger than the limit is still taken once
+	 * the queue is empty. */
+	void enqueue(async_freeable *pool, void *ptr, void (*destroy)(void *), size_t bytes)
+	{
+		std::unique_lock guard{lock};
+
+		if(std::this_thread::get_id() != worker.get_id())
+			done.wait(guard, [&]() { return queued_bytes == 0 || queued_bytes + bytes <= limit; });
+
+		queue.push_back({pool, ptr, destroy, bytes});
+		queued_bytes += bytes;
+
+		if(!worker.joinable())
+			worker = std::thread{&pool_reclaimer::run, this};
+		else if(queue.size() == 1)
+			work.notify_one();
+	}
+
+	/* Waits until everything queued so far, and whatever its destructors
+	 * queued in turn, has been freed. Does nothing on the reclaimer itself. */
+	void drain()
+	{
+		std::unique_lock guard{lock};
+
+		if(std::this_thread::get_id() == worker.get_id())
+			return;
+
+		done.wait(guard, [this]() { return queue.empty() && started == finished; });
+	}
+};
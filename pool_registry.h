@@ -0,0 +1,304 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <functional>
+#include <mutex>
+#include <poll.h>
+#include <string>
+#include <sys/eventfd.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+/* Anything that can give memory back on request. memory_pool registers
+ * itself with the pool_registry on construction. */
+class reclaimable_pool
+{
+public:
+	/* Returns the number of bytes given back */
+	virtual size_t reclaim() = 0;
+protected:
+	~reclaimable_pool() = default;
+};
+
+struct pressure_monitor_config
+{
+	/* PSI trigger: reclaim when tasks stall on memory for stall_us per window_us */
+	unsigned int psi_stall_us = 150000;
+	unsigned int psi_window_us = 1000000;
+	/* Without PSI, how often to check usage against the cgroup limit, and
+	 * the fraction of the limit at which to start reclaiming */
+	unsigned int poll_interval_ms = 1000;
+	double usage_threshold = 0.9;
+};
+
+/* Global list of pools plus user shrinkers (object caches built on top of the
+ * pools, which hold on to objects the pools can't free themselves), and a
+ * monitor thread that runs all of them when the container gets close to its
+ * memory limit, before the OOM killer gets involved.
+ *
+ * Reclaim runs with the registry lock held: shrinkers must not register or
+ * unregister shrinkers or pools themselves. */
+class pool_registry
+{
+private:
+	std::mutex lock;
+	std::vector<reclaimable_pool *> pools;
+	std::vector<std::pair<unsigned long, std::function<size_t()>>> shrinkers;
+	unsigned long next_shrinker_id;
+	std::thread monitor;
+	int wake_fd;
+	std::atomic<size_t> nr_reclaims;
+
+	pool_registry() : lock{}, pools{}, shrinkers{}, next_shrinker_id{1}, monitor{}, wake_fd{-1}, nr_reclaims{0} {}
+
+	~pool_registry()
+	{
+		stop_monitor();
+	}
+
+	/* The cgroup (v2, or the v1 memory controller) we're in, as a directory */
+	static std::string cgroup_dir()
+	{
+		std::string v2, v1;
+		FILE *f = fopen("/proc/self/cgroup", "r");
+		if(!f)
+			return {};
+
+		char line[512];
+		while(fgets(line, sizeof(line), f))
+		{
+			std::string l{line};
+			if(!l.empty() && l.back() == '\n')
+				l.pop_back();
+
+			if(l.compare(0, 3, "0::") == 0)
+				v2 = "/sys/fs/cgroup" + l.substr(3);
+			else if(auto pos = l.find(":memory:"); pos != std::string::npos)
+				v1 = "/sys/fs/cgroup/memory" + l.substr(pos + 8);
+		}
+
+		fclose(f);
+
+		if(!v2.empty() && access((v2 + "/memory.current").c_str(), R_OK) == 0)
+			return v2;
+		return v1;
+	}
+
+	static bool read_number(const std::string &path, unsigned long &value)
+	{
+		FILE *f = fopen(path.c_str(), "r");
+		if(!f)
+			return false;
+
+		bool ok = fscanf(f, "%lu", &value) == 1;
+		fclose(f);
+		return ok;
+	}
+
+	/* Sums the high/max/oom counters of a cgroup v2 memory.events file */
+	static unsigned long read_memory_events(int fd)
+	{
+		char buf[512];
+		auto len = pread(fd, buf, sizeof(buf) - 1, 0);
+		if(len <= 0)
+			return 0;
+		buf[len] = '\0';
+
+		unsigned long total = 0;
+		for(char *line = strtok(buf, "\n"); line; line = strtok(nullptr, "\n"))
+		{
+			char key[32];
+			unsigned long value;
+			if(sscanf(line, "%31s %lu", key, &value) == 2 && strcmp(key, "low") != 0)
+				total += value;
+		}
+
+		return total;
+	}
+
+	/* Fallback when there's nothing to poll: usage against the cgroup limit,
+	 * or against the whole machine's memory without one */
+	static bool over_threshold(const std::string &cgroup, double threshold)
+	{
+		unsigned long usage, limit;
+
+		if(read_number(cgroup + "/memory.current", usage) && read_number(cgroup + "/memory.max", limit))
+			return usage >= threshold * limit;
+		if(read_number(cgroup + "/memory.usage_in_bytes", usage) &&
+		   read_number(cgroup + "/memory.limit_in_bytes", limit))
+			return usage >= threshold * limit;
+
+		FILE *f = fopen("/proc/meminfo", "r");
+		if(!f)
+			return false;
+
+		unsigned long total = 0, available = 0, value;
+		char key[64];
+		while(fscanf(f, "%63s %lu kB", key, &value) == 2)
+		{
+			if(!strcmp(key, "MemTotal:"))
+				total = value;
+			else if(!strcmp(key, "MemAvailable:"))
+				available = value;
+		}
+
+		fclose(f);
+		return total && total - available >= threshold * total;
+	}
+
+	static int open_psi_trigger(const std::string &cgroup, const pressure_monitor_config &config)
+	{
+		char trigger[64];
+		snprintf(trigger, sizeof(trigger), "some %u %u", config.psi_stall_us, config.psi_window_us);
+
+		for(auto path : {cgroup + "/memory.pressure", std::string{"/proc/pressure/memory"}})
+		{
+			int fd = open(path.c_str(), O_RDWR | O_NONBLOCK | O_CLOEXEC);
+			if(fd < 0)
+				continue;
+
+			if(write(fd, trigger, strlen(trigger) + 1) >= 0)
+				return fd;
+			close(fd);
+		}
+
+		return -1;
+	}
+
+	void monitor_loop(int stop_fd, pressure_monitor_config config)
+	{
+		auto cgroup = cgroup_dir();
+		int psi_fd = open_psi_trigger(cgroup, config);
+		int events_fd = open((cgroup + "/memory.events").c_str(), O_RDONLY | O_CLOEXEC);
+		unsigned long events = events_fd >= 0 ? read_memory_events(events_fd) : 0;
+
+		while(true)
+		{
+			pollfd fds[3] = {{stop_fd, POLLIN, 0}, {psi_fd, POLLPRI, 0}, {events_fd, POLLPRI, 0}};
+			/* Without PSI, fall back to polling the usage */
+			int timeout = psi_fd >= 0 ? -1 : static_cast<int>(config.poll_interval_ms);
+
+			if(poll(fds, 3, timeout) < 0 && errno != EINTR)
+				break;
+
+			if(fds[0].revents)
+				break;
+
+			bool pressure = fds[1].revents & POLLPRI;
+
+			if(fds[2].revents & POLLPRI)
+			{
+				auto now = read_memory_events(events_fd);
+				pressure |= now != events;
+				events = now;
+			}
+
+			if(psi_fd < 0 && over_threshold(cgroup, config.usage_threshold))
+				pressure = true;
+
+			if(pressure)
+				reclaim();
+		}
+
+		if(psi_fd >= 0)
+			close(psi_fd);
+		if(events_fd >= 0)
+			close(events_fd);
+	}
+
+public:
+	static pool_registry &instance()
+	{
+		static pool_registry registry;
+		return registry;
+	}
+
+	pool_registry(const pool_registry &rhs) = delete;
+	pool_registry& operator=(const pool_registry &rhs) = delete;
+
+	void add(reclaimable_pool *pool)
+	{
+		std::scoped_lock guard{lock};
+		pools.push_back(pool);
+	}
+
+	void remove(reclaimable_pool *pool)
+	{
+		std::scoped_lock guard{lock};
+		pools.erase(std::remove(pools.begin(), pools.end(), pool), pools.end());
+	}
+
+	/* A shrinker returns the number of bytes it freed. Returns an id for
+	 * unregister_shrinker(). */
+	unsigned long register_shrinker(std::function<size_t()> shrinker)
+	{
+		std::scoped_lock guard{lock};
+		auto id = next_shrinker_id++;
+		shrinkers.emplace_back(id, std::move(shrinker));
+		return id;
+	}
+
+	void unregister_shrinker(unsigned long id)
+	{
+		std::scoped_lock guard{lock};
+		shrinkers.erase(std::remove_if(shrinkers.begin(), shrinkers.end(),
+					       [id](auto &s) { return s.first == id; }), shrinkers.end());
+	}
+
+	/* Runs the shrinkers first, so the objects they drop can go back to the
+	 * pools before the pools reclaim. Returns the number of bytes freed. */
+	size_t reclaim()
+	{
+		std::scoped_lock guard{lock};
+		size_t freed = 0;
+
+		for(auto &s : shrinkers)
+			freed += s.second();
+		for(auto p : pools)
+			freed += p->reclaim();
+
+		nr_reclaims.fetch_add(1, std::memory_order_relaxed);
+		return freed;
+	}
+
+	size_t reclaims() const
+	{
+		return nr_reclaims.load(std::memory_order_relaxed);
+	}
+
+	/* Starts the pressure monitor thread: a PSI trigger on the cgroup (or the
+	 * whole system) plus memory.events notifications, or usage polling when
+	 * neither can be set up. */
+	bool start_monitor(const pressure_monitor_config &config = {})
+	{
+		if(monitor.joinable())
+			return false;
+
+		wake_fd = eventfd(0, EFD_CLOEXEC);
+		if(wake_fd < 0)
+			return false;
+
+		monitor = std::thread{&pool_registry::monitor_loop, this, wake_fd, config};
+		return true;
+	}
+
+	void stop_monitor()
+	{
+		if(!monitor.joinable())
+			return;
+
+		uint64_t one = 1;
+		if(write(wake_fd, &one, sizeof(one)) != sizeof(one))
+			std::perror("pool_registry: eventfd write");
+		monitor.join();
+		close(wake_fd);
+		wake_fd = -1;
+	}
+};
@@ -0,0 +1,285 @@
+#pragma once
+
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <linux/mempolicy.h>
+#include <string>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+enum class numa_policy
+{
+	/* Whatever the thread's policy is */
+	none,
+	/* The node of the CPU that first touches the page */
+	local,
+	/* Spread pages over every online node */
+	interleave
+};
+
+enum class chunk_layout
+{
+	/* Chunks back to back, some of them cross page and cache line boundaries */
+	dense,
+	/* No chunk crosses a page boundary, so touching an object faults in and
+	 * takes a TLB entry for one page only */
+	page,
+	/* No chunk crosses a cache line, for chunks of up to a cache line */
+	cache_line
+};
+
+/* Knobs that only matter when memory_pool maps, caches or unmaps segments.
+ * allocate() and free() stay compiled for the policy picked by the macros in
+ * memory_pool.h; nothing in here is looked at while there are free chunks
+ * around.
+ *
+ * A pool takes its tunables when it's created, by default from the
+ * MEMORY_POOL_CONFIG environment variable, e.g.
+ *	MEMORY_POOL_CONFIG=segment_size=2097152,huge_pages=1,numa=interleave */
+struct memory_pool_tunables
+{
+	/* Bytes per segment, rounded up to whole pages; 0 sizes it for the type */
+	size_t segment_size = 0;
+	/* Empty segments to keep mapped instead of unmapping them on free() */
+	size_t empty_segments = 0;
+	/* purge() leaves segments alone until they have been empty this long;
+	 * reclaim() under memory pressure doesn't wait */
+	std::chrono::milliseconds purge_delay{0};
+	/* Ask for transparent huge pages; segments of 2 MiB or more get aligned for them */
+	bool huge_pages = false;
+	/* Grow the newest segment in place before mapping a new one, up to
+	 * max_segment_size. Every segment then reserves the address space, and
+	 * an occupancy map entry, for each page it could grow to, which is why
+	 * this is off by default. */
+	bool grow_in_place = false;
+	numa_policy numa = numa_policy::none;
+	/* Where chunks go in a segment; allocate() and free() never compute a
+	 * chunk's address, so this costs nothing but the padding */
+	chunk_layout layout = chunk_layout::dense;
+	/* Count segment maps/unmaps and failed expansions, see memory_pool::stats() */
+	bool stats = false;
+	/* With OBJECT_POOL_SAMPLED_HARDENING, check about one in sample_rate
+	 * allocations (0 for none). Sampled objects get a guard page slot while
+	 * one of the guarded_slots is free; otherwise they get a canary after
+	 * the object, if there's padding for it, and are poisoned and
+	 * quarantined for a while once freed. */
+	size_t sample_rate = 0;
+	size_t guarded_slots = 16;
+	/* Chunks set aside for allocate_critical() once the pool maps memory */
+	size_t reserved_objects = 0;
+
+	/* Let the pool adjust empty_segments and segment_size by itself. Every
+	 * tune_interval it looks at what its slow paths did: segments that got
+	 * unmapped only to be mapped again grow the empty segment cache, a
+	 * quickly growing pool gets bigger segments, and both shrink back towards
+	 * the configured values once things calm down. */
+	bool self_tune = false;
+	size_t max_empty_segments = 64;
+	/* Also how far grow_in_place grows a segment */
+	size_t max_segment_size = 1024 * 1024;
+	std::chrono::milliseconds tune_interval{100};
+	/* Print every tuning decision to stderr */
+	bool log_tuning = false;
+
+	/* Applies a comma separated list of key=value pairs on top of the
+	 * current values. Returns false, with errno set to EINVAL, if any of them
+	 * is bad; the good ones are applied anyway. */
+	bool parse(const char *config)
+	{
+		bool ok = true;
+		std::string s{config};
+		size_t pos = 0;
+
+		while(pos < s.size())
+		{
+			auto end = s.find(',', pos);
+			if(end == std::string::npos)
+				end = s.size();
+
+			auto item = s.substr(pos, end - pos);
+			pos = end + 1;
+			if(item.empty())
+				continue;
+
+			auto eq = item.find('=');
+			if(eq == std::string::npos || !set(item.substr(0, eq), item.substr(eq + 1)))
+			{
+				std::fprintf(stderr, "memory_pool: bad tunable '%s'\n", item.c_str());
+				ok = false;
+			}
+		}
+
+		if(!ok)
+			errno = EINVAL;
+		return ok;
+	}
+
+	/* The defaults, overridden by the environment variable if it's set */
+	static memory_pool_tunables from_env(const char *var = "MEMORY_POOL_CONFIG")
+	{
+		memory_pool_tunables t;
+		if(auto config = std::getenv(var))
+			t.parse(config);
+		return t;
+	}
+
+private:
+	static bool to_number(const std::string &value, unsigned long long &n)
+	{
+		char *end;
+		errno = 0;
+		n = std::strtoull(value.c_str(), &end, 0);
+		return !value.empty() && *end == '\0' && errno == 0;
+	}
+
+	bool set(const std::string &key, const std::string &value)
+	{
+		unsigned long long n;
+
+		if(key == "numa")
+		{
+			if(value == "none")
+				numa = numa_policy::none;
+			else if(value == "local")
+				numa = numa_policy::local;
+			else if(value == "interleave")
+				numa = numa_policy::interleave;
+			else
+				return false;
+			return true;
+		}
+
+		if(key == "layout")
+		{
+			if(value == "dense")
+				layout = chunk_layout::dense;
+			else if(value == "page")
+				layout = chunk_layout::page;
+			else if(value == "cache_line")
+				layout = chunk_layout::cache_line;
+			else
+				return false;
+			return true;
+		}
+
+		if(!to_number(value, n))
+			return false;
+
+		if(key == "segment_size")
+			segment_size = n;
+		else if(key == "empty_segments")
+			empty_segments = n;
+		else if(key == "purge_delay_ms")
+			purge_delay = std::chrono::milliseconds{n};
+		else if(key == "huge_pages")
+			huge_pages = n != 0;
+		else if(key == "grow_in_place")
+			grow_in_place = n != 0;
+		else if(key == "stats")
+			stats = n != 0;
+		else if(key == "sample_rate")
+			sample_rate = n;
+		else if(key == "guarded_slots")
+			guarded_slots = n;
+		else if(key == "reserved_objects")
+			reserved_objects = n;
+		else if(key == "self_tune")
+			self_tune = n != 0;
+		else if(key == "max_empty_segments")
+			max_empty_segments = n;
+		else if(key == "max_segment_size")
+			max_segment_size = n;
+		else if(key == "tune_interval_ms")
+			tune_interval = std::chrono::milliseconds{n};
+		else if(key == "log_tuning")
+			log_tuning = n != 0;
+		else
+			return false;
+
+		return true;
+	}
+};
+
+/* Slow-path event counters, only kept if memory_pool_tunables::stats is set */
+struct memory_pool_stats
+{
+	size_t segments_mapped = 0;
+	size_t segments_unmapped = 0;
+	size_t segments_grown = 0;
+	size_t failed_expansions = 0;
+	size_t bytes_released = 0;
+	size_t tuning_decisions = 0;
+	/* Allocations allocate_critical() served from the reserve */
+	size_t critical_allocations = 0;
+};
+
+/* What a pool holds right now, see memory_pool::usage(). Unlike the stats,
+ * this is always available, but takes a walk over every segment. */
+struct memory_pool_usage
+{
+	size_t segments = 0;
+	size_t empty_segments = 0;
+	/* Bytes of every segment, including pages given back by release_free_pages() */
+	size_t mapped_bytes = 0;
+	size_t live_objects = 0;
+	size_t reserved_objects = 0;
+};
+
+/* Mask of the online nodes, read once. Online nodes look like "0-3,6". */
+static inline unsigned long numa_online_nodes()
+{
+	static const unsigned long nodemask = []()
+	{
+		unsigned long mask = 0;
+		FILE *f = std::fopen("/sys/devices/system/node/online", "r");
+		if(!f)
+			return mask;
+
+		unsigned int first, last;
+		char sep = 0;
+		while(std::fscanf(f, "%u", &first) == 1)
+		{
+			last = first;
+			if(std::fscanf(f, "%c", &sep) == 1 && sep == '-' && std::fscanf(f, "%u%c", &last, &sep) < 1)
+				break;
+			for(auto n = first; n <= last && n < 8 * sizeof(mask); n++)
+				mask |= 1UL << n;
+			if(sep != ',')
+				break;
+		}
+
+		std::fclose(f);
+		return mask;
+	}();
+
+	return nodemask;
+}
+
+/* Sets the NUMA policy of a freshly mapped range, before anything touches it.
+ * Best effort: without NUMA support the pages just land wherever they would. */
+static inline void apply_numa_policy(void *addr, size_t len, numa_policy policy)
+{
+	unsigned long nodemask = 0;
+	int mode;
+
+	switch(policy)
+	{
+		case numa_policy::local:
+			mode = MPOL_LOCAL;
+			break;
+		case numa_policy::interleave:
+			nodemask = numa_online_nodes();
+			if(!nodemask)
+				return;
+			mode = MPOL_INTERLEAVE;
+			break;
+		default:
+			return;
+	}
+
+	syscall(SYS_mbind, addr, len, mode, nodemask ? &nodemask : nullptr,
+		nodemask ? 8 * sizeof(nodemask) + 1 : 0, 0);
+}
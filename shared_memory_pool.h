@@ -0,0 +1,383 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <type_traits>
+#include <unistd.h>
+
+#include "memory_pool.h"
+
+/* A memory pool whose objects live in a memfd region mapped by several
+ * processes, so objects can be handed from one process to another without
+ * copying. Unlike memory_pool, which grows by segments, this is a single
+ * region sized once at creation: every process has to be able to map all of
+ * it, so it can't grow under them. Pages only get faulted in as chunks are
+ * first carved out.
+ *
+ * Each process maps the region at its own address, so objects are passed
+ * between processes by offset_of()/at(). Everything shared is an address-free
+ * atomic, which works across processes.
+ *
+ * A chunk belongs to whoever wins the compare-exchange of its owner word from
+ * 0 to their pid; free() stores 0 back. A bitmap at the end of the region has
+ * a bit set for chunks that are probably free, but it's only a hint: a stale
+ * bit costs a failed compare-exchange, and a missing one is put back by
+ * recover(). So a process can die anywhere in allocate() or free() without
+ * losing the chunk. transfer() hands an object to another process, and
+ * recover() frees the objects of processes that died. */
+
+/* The part of the header a process checks before mapping the region */
+struct shared_memory_pool_layout
+{
+	uint64_t magic;
+	uint32_t version;
+	uint32_t pad0;
+	uint64_t object_size;
+	uint64_t chunk_size;
+	uint64_t nr_chunks;
+};
+
+struct shared_memory_pool_header
+{
+	shared_memory_pool_layout layout;
+	/* The bitmap word free() last set a bit in, where allocate() looks first */
+	std::atomic<uint64_t> free_hint;
+	/* Chunks below this index have been carved out of the region */
+	std::atomic<uint64_t> carved;
+	std::atomic<uint64_t> used_objects;
+};
+
+struct shared_memory_chunk
+{
+	std::atomic<int32_t> owner;
+	uint32_t pad0;
+	uint64_t pad1;
+	/* Note that this is 16-byte aligned */
+};
+
+/* getpid() is a real syscall since glibc 2.25, too slow for every
+ * allocate(). The cached pid is refreshed in forked children, but not in
+ * children made by a raw clone(). */
+static inline pid_t shared_memory_pool_pid()
+{
+	static pid_t pid = []()
+	{
+		pthread_atfork(nullptr, nullptr, []() { pid = getpid(); });
+		return getpid();
+	}();
+
+	return pid;
+}
+
+static constexpr uint64_t shared_memory_pool_magic = 0x4c4f4f504d485353;	/* "SSHMPOOL" */
+static constexpr uint32_t shared_memory_pool_version = 2;
+
+template <typename T>
+class shared_memory_pool
+{
+	static_assert(std::is_trivially_copyable_v<T>, "shared objects can't hold process-local state");
+	static_assert(std::atomic<uint64_t>::is_always_lock_free && std::atomic<uint32_t>::is_always_lock_free,
+		      "process-shared atomics need to be lock-free");
+private:
+	static constexpr size_t alignment = default_object_alignment<T>();
+
+	int memfd;
+	unsigned char *base;
+	size_t region_size;
+	shared_memory_pool_header *header;
+
+	static constexpr size_t size_of_chunk()
+	{
+		return align_up(sizeof(shared_memory_chunk) + sizeof(T), alignment);
+	}
+
+	static constexpr size_t first_chunk_offset()
+	{
+		return align_up(align_up(sizeof(shared_memory_pool_header), object_pool_alignment)
+				+ sizeof(shared_memory_chunk), alignment) - sizeof(shared_memory_chunk);
+	}
+
+	shared_memory_pool(int memfd, void *base, size_t region_size) : memfd{memfd},
+		base{static_cast<unsigned char *>(base)}, region_size{region_size},
+		header{static_cast<shared_memory_pool_header *>(base)} {}
+
+	static constexpr size_t free_map_words(uint64_t nr_chunks)
+	{
+		return (nr_chunks + 63) / 64;
+	}
+
+	/* The free bitmap sits after the last chunk */
+	static constexpr size_t free_map_offset(uint64_t nr_chunks)
+	{
+		return align_up(first_chunk_offset() + nr_chunks * size_of_chunk(), sizeof(uint64_t));
+	}
+
+	static constexpr size_t size_of_region(uint64_t nr_chunks)
+	{
+		return align_up(free_map_offset(nr_chunks) + free_map_words(nr_chunks) * sizeof(uint64_t),
+				static_cast<size_t>(PAGE_SIZE));
+	}
+
+	shared_memory_chunk *chunk_at(uint32_t index) const
+	{
+		return reinterpret_cast<shared_memory_chunk *>(base + first_chunk_offset() + index * size_of_chunk());
+	}
+
+	uint32_t chunk_index(const shared_memory_chunk *chunk) const
+	{
+		return (reinterpret_cast<const unsigned char *>(chunk) - base - first_chunk_offset()) / size_of_chunk();
+	}
+
+	std::atomic<uint64_t> *free_map() const
+	{
+		return reinterpret_cast<std::atomic<uint64_t> *>(base + free_map_offset(header->layout.nr_chunks));
+	}
+
+	void mark_free(uint32_t index)
+	{
+		free_map()[index / 64].fetch_or(1UL << (index % 64), std::memory_order_release);
+		header->free_hint.store(index / 64, std::memory_order_relaxed);
+	}
+
+	bool claim(shared_memory_chunk *chunk, pid_t pid)
+	{
+		int32_t expected = 0;
+		return chunk->owner.compare_exchange_strong(expected, pid, std::memory_order_acquire,
+							    std::memory_order_relaxed);
+	}
+
+	/* Takes a chunk marked in the free bitmap, starting at the hint */
+	shared_memory_chunk *take_free_chunk(pid_t pid)
+	{
+		auto map = free_map();
+		auto nr_words = free_map_words(header->layout.nr_chunks);
+		auto first = header->free_hint.load(std::memory_order_relaxed);
+
+		for(size_t i = 0; i < nr_words; i++)
+		{
+			auto w = (first + i) % nr_words;
+			auto bits = map[w].load(std::memory_order_relaxed);
+
+			while(bits)
+			{
+				auto bit = __builtin_ctzl(bits);
+				auto mask = 1UL << bit;
+				bits = map[w].fetch_and(~mask, std::memory_order_acquire);
+				if(bits & mask && claim(chunk_at(w * 64 + bit), pid))
+					return chunk_at(w * 64 + bit);
+				bits &= ~mask;
+			}
+		}
+
+		return nullptr;
+	}
+
+	shared_memory_chunk *carve_chunk(pid_t pid)
+	{
+		while(true)
+		{
+			auto index = header->carved.fetch_add(1, std::memory_order_relaxed);
+			if(index >= header->layout.nr_chunks)
+			{
+				header->carved.fetch_sub(1, std::memory_order_relaxed);
+				return nullptr;
+			}
+
+			/* recover() may have marked it free already and let someone
+			 * else take it */
+			if(claim(chunk_at(index), pid))
+				return chunk_at(index);
+		}
+	}
+
+	static std::unique_ptr<shared_memory_pool> map(int fd, size_t region_size)
+	{
+		void *base = mmap(nullptr, region_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if(base == MAP_FAILED)
+			return nullptr;
+
+		return std::unique_ptr<shared_memory_pool>{new shared_memory_pool{fd, base, region_size}};
+	}
+
+public:
+	/* Creates a region for up to capacity objects. Other processes get at it
+	 * through fd(), inherited across fork or passed with SCM_RIGHTS. */
+	static std::unique_ptr<shared_memory_pool> create(size_t capacity, const char *name = "memory_pool")
+	{
+		if(capacity == 0 || capacity >= UINT32_MAX)
+		{
+			errno = EINVAL;
+			return nullptr;
+		}
+
+		auto region_size = size_of_region(capacity);
+		int fd = memfd_create(name, MFD_CLOEXEC);
+		if(fd < 0)
+			return nullptr;
+
+		std::unique_ptr<shared_memory_pool> pool;
+		if(ftruncate(fd, region_size) < 0 || !(pool = map(fd, region_size)))
+		{
+			auto err = errno;
+			close(fd);
+			errno = err;
+			return nullptr;
+		}
+
+		auto header = new (pool->base) shared_memory_pool_header{};
+		header->layout.version = shared_memory_pool_version;
+		header->layout.object_size = sizeof(T);
+		header->layout.chunk_size = size_of_chunk();
+		header->layout.nr_chunks = capacity;
+		header->layout.magic = shared_memory_pool_magic;
+
+		return pool;
+	}
+
+	/* Maps a region made by create() in another process. Takes ownership of
+	 * fd; returns nullptr with errno set if the region doesn't hold Ts. */
+	static std::unique_ptr<shared_memory_pool> attach(int fd)
+	{
+		shared_memory_pool_layout layout;
+		std::unique_ptr<shared_memory_pool> pool;
+
+		auto len = pread(fd, &layout, sizeof(layout), 0);
+		if(len != sizeof(layout))
+		{
+			if(len >= 0)
+				errno = EPROTO;
+		}
+		else if(layout.magic != shared_memory_pool_magic || layout.version != shared_memory_pool_version ||
+			layout.object_size != sizeof(T) || layout.chunk_size != size_of_chunk())
+			errno = EPROTO;
+		else
+			pool = map(fd, size_of_region(layout.nr_chunks));
+
+		if(!pool)
+		{
+			auto err = errno;
+			close(fd);
+			errno = err;
+		}
+
+		return pool;
+	}
+
+	~shared_memory_pool()
+	{
+		munmap(base, region_size);
+		close(memfd);
+	}
+
+	shared_memory_pool(const shared_memory_pool &rhs) = delete;
+	shared_memory_pool& operator=(const shared_memory_pool &rhs) = delete;
+
+	T *allocate()
+	{
+		auto pid = shared_memory_pool_pid();
+		shared_memory_chunk *chunk = nullptr;
+
+		/* Count the object before it has an owner, so recover() never
+		 * takes away one that wasn't counted */
+		auto used = header->used_objects.fetch_add(1, std::memory_order_relaxed);
+
+		/* Only search the bitmap when something was freed since carving,
+		 * so the carving phase doesn't scan it on every allocation */
+		auto carved = std::min<uint64_t>(header->carved.load(std::memory_order_relaxed), header->layout.nr_chunks);
+		if(used < carved)
+			chunk = take_free_chunk(pid);
+		if(!chunk)
+			chunk = carve_chunk(pid);
+		if(!chunk)
+			chunk = take_free_chunk(pid);
+		if(!chunk)
+		{
+			header->used_objects.fetch_sub(1, std::memory_order_relaxed);
+			return nullptr;
+		}
+
+		return reinterpret_cast<T *>(chunk + 1);
+	}
+
+	void free(T *ptr)
+	{
+		auto chunk = reinterpret_cast<shared_memory_chunk *>(ptr) - 1;
+
+		[[maybe_unused]] auto owner = chunk->owner.exchange(0, std::memory_order_release);
+		assert(owner != 0);
+		header->used_objects.fetch_sub(1, std::memory_order_relaxed);
+		mark_free(chunk_index(chunk));
+	}
+
+	/* Makes pid the owner of the object, so that it survives us dying */
+	void transfer(T *ptr, pid_t pid)
+	{
+		auto chunk = reinterpret_cast<shared_memory_chunk *>(ptr) - 1;
+		chunk->owner.store(pid, std::memory_order_relaxed);
+	}
+
+	/* Frees every object owned by a process that doesn't exist anymore and
+	 * returns how many there were. Also marks free chunks that a dying
+	 * process left out of the bitmap. */
+	size_t recover()
+	{
+		size_t recovered = 0;
+		auto carved = std::min<uint64_t>(header->carved.load(std::memory_order_acquire), header->layout.nr_chunks);
+
+		for(uint32_t i = 0; i < carved; i++)
+		{
+			auto chunk = chunk_at(i);
+			int32_t owner = chunk->owner.load(std::memory_order_relaxed);
+
+			if(owner == 0)
+			{
+				/* A stale bit is harmless, so no need to be exact here */
+				if(!(free_map()[i / 64].load(std::memory_order_relaxed) & 1UL << (i % 64)))
+					mark_free(i);
+				continue;
+			}
+
+			if(kill(owner, 0) == 0 || errno != ESRCH)
+				continue;
+
+			/* Somebody else may be recovering it at the same time */
+			if(!chunk->owner.compare_exchange_strong(owner, 0, std::memory_order_relaxed))
+				continue;
+
+			header->used_objects.fetch_sub(1, std::memory_order_relaxed);
+			mark_free(i);
+			recovered++;
+		}
+
+		return recovered;
+	}
+
+	uint64_t offset_of(const T *ptr) const
+	{
+		return ptr ? reinterpret_cast<const unsigned char *>(ptr) - base : 0;
+	}
+
+	T *at(uint64_t offset) const
+	{
+		return offset ? reinterpret_cast<T *>(base + offset) : nullptr;
+	}
+
+	int fd() const
+	{
+		return memfd;
+	}
+
+	/* Stays one too high for each process that died inside allocate() or
+	 * free() */
+	size_t used_objects() const
+	{
+		return header->used_objects.load(std::memory_order_relaxed);
+	}
+};
@@ -0,0 +1,256 @@
+#include "memory_pool.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <malloc.h>
+#include <random>
+#include <string>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+/* Soak test: runs allocation phases over and over for a fixed time and
+ * prints a time series of RSS, mapped bytes, segments and fragmentation as
+ * CSV, so that memory creep shows up and runs of different versions can be
+ * compared. Every allocator runs in its own child process, so their RSS
+ * doesn't mix.
+ *
+ *	soak [seconds] [live objects] [phases] [sample interval ms]
+ *
+ * phases is a comma separated list of name:seconds, with names from
+ * phase_kinds, and defaults to grow:5,churn:20,release:5,regrow:5. */
+
+class object
+{
+private:
+	unsigned long data[8];
+};
+
+struct phase
+{
+	std::string name;
+	/* The live set goes from from to to, as fractions of the peak, over the phase */
+	double from, to;
+	std::chrono::milliseconds length;
+};
+
+static const struct
+{
+	const char *name;
+	double from, to;
+} phase_kinds[] = {
+	{"grow", 0, 1},
+	{"churn", 1, 1},
+	{"release", 1, 0.25},
+	{"regrow", 0.25, 1},
+};
+
+struct sample
+{
+	size_t live_objects;
+	size_t mapped_bytes;
+	size_t segments;
+};
+
+/* memory_pool, purged incrementally after every sample like an event loop
+ * would from its idle hook */
+struct pool_allocator
+{
+	static constexpr const char *name = "memory_pool";
+	memory_pool<object> pool;
+
+	object *allocate()
+	{
+		return pool.allocate();
+	}
+
+	void free(object *o)
+	{
+		pool.free(o);
+	}
+
+	sample sampled()
+	{
+		pool.purge(std::chrono::microseconds{100});
+		auto u = pool.usage();
+		return {u.live_objects, u.mapped_bytes, u.segments};
+	}
+};
+
+/* The system malloc; malloc.c isn't an allocator yet */
+struct malloc_allocator
+{
+	static constexpr const char *name = "malloc";
+	size_t live = 0;
+
+	object *allocate()
+	{
+		live++;
+		return static_cast<object *>(std::malloc(sizeof(object)));
+	}
+
+	void free(object *o)
+	{
+		live--;
+		std::free(o);
+	}
+
+	sample sampled()
+	{
+		auto mi = mallinfo2();
+		return {live, mi.arena + mi.hblkhd, 0};
+	}
+};
+
+static size_t rss_bytes()
+{
+	unsigned long size, resident;
+	FILE *f = std::fopen("/proc/self/statm", "r");
+	if(!f)
+		return 0;
+
+	bool ok = std::fscanf(f, "%lu %lu", &size, &resident) == 2;
+	std::fclose(f);
+	return ok ? resident * PAGE_SIZE : 0;
+}
+
+static bool parse_phases(const char *spec, std::vector<phase> &phases)
+{
+	std::string s{spec};
+	size_t pos = 0;
+
+	while(pos < s.size())
+	{
+		auto end = s.find(',', pos);
+		if(end == std::string::npos)
+			end = s.size();
+
+		auto item = s.substr(pos, end - pos);
+		pos = end + 1;
+
+		auto colon = item.find(':');
+		if(colon == std::string::npos)
+			return false;
+
+		auto name = item.substr(0, colon);
+		auto seconds = std::strtod(item.c_str() + colon + 1, nullptr);
+		bool found = false;
+		for(auto &k : phase_kinds)
+		{
+			if(name != k.name)
+				continue;
+			phases.push_back({name, k.from, k.to, std::chrono::milliseconds{static_cast<long>(seconds * 1000)}});
+			found = true;
+		}
+
+		if(!found || seconds <= 0)
+			return false;
+	}
+
+	return !phases.empty();
+}
+
+template <typename Allocator>
+static void soak(const std::vector<phase> &phases, std::chrono::seconds duration, size_t peak,
+		 std::chrono::milliseconds interval)
+{
+	using clock = std::chrono::steady_clock;
+	Allocator allocator;
+	std::vector<object *> live;
+	std::mt19937_64 rng{42};
+	size_t peak_rss = 0, operations = 0;
+	sample last{};
+
+	auto start = clock::now();
+	auto next_sample = start;
+
+	for(size_t p = 0; clock::now() - start < duration; p = (p + 1) % phases.size())
+	{
+		auto &ph = phases[p];
+		auto phase_start = clock::now();
+
+		while(clock::now() - phase_start < ph.length && clock::now() - start < duration)
+		{
+			auto now = clock::now();
+			double progress = std::chrono::duration<double>(now - phase_start) / ph.length;
+			auto target = static_cast<size_t>(peak * (ph.from + (ph.to - ph.from) * progress));
+
+			/* Move towards the target, and churn a random object either way */
+			for(int i = 0; i < 1024; i++, operations++)
+			{
+				if(live.size() > target || (live.size() == target && !live.empty()))
+				{
+					auto victim = rng() % live.size();
+					allocator.free(live[victim]);
+					live[victim] = live.back();
+					live.pop_back();
+				}
+
+				if(live.size() < target)
+					live.push_back(allocator.allocate());
+			}
+
+			if(now < next_sample)
+				continue;
+			next_sample += interval;
+
+			last = allocator.sampled();
+			auto rss = rss_bytes();
+			peak_rss = std::max(peak_rss, rss);
+			std::printf("%s,%.3f,%s,%zu,%zu,%zu,%zu,%.3f\n", Allocator::name,
+				    std::chrono::duration<double>(now - start).count(), ph.name.c_str(),
+				    last.live_objects, rss, last.mapped_bytes, last.segments,
+				    last.live_objects ? static_cast<double>(last.mapped_bytes) /
+							(last.live_objects * sizeof(object)) : 0.0);
+			std::fflush(stdout);
+		}
+	}
+
+	std::printf("# %s: %zu operations, peak rss %zu, final rss %zu, final mapped %zu for %zu live objects\n",
+		    Allocator::name, operations, peak_rss, rss_bytes(), last.mapped_bytes, last.live_objects);
+
+	for(auto o : live)
+		allocator.free(o);
+}
+
+template <typename Allocator>
+static bool soak_in_child(const std::vector<phase> &phases, std::chrono::seconds duration, size_t peak,
+			  std::chrono::milliseconds interval)
+{
+	std::fflush(stdout);
+	pid_t pid = fork();
+	if(pid < 0)
+		return false;
+
+	if(pid == 0)
+	{
+		soak<Allocator>(phases, duration, peak, interval);
+		std::fflush(stdout);
+		_exit(0);
+	}
+
+	int status;
+	return waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+int main(int argc, char **argv)
+{
+	std::chrono::seconds duration{argc > 1 ? std::strtoul(argv[1], nullptr, 0) : 60};
+	size_t peak = argc > 2 ? std::strtoul(argv[2], nullptr, 0) : 1000000;
+	const char *spec = argc > 3 ? argv[3] : "grow:5,churn:20,release:5,regrow:5";
+	std::chrono::milliseconds interval{argc > 4 ? std::strtoul(argv[4], nullptr, 0) : 1000};
+	std::vector<phase> phases;
+
+	if(!parse_phases(spec, phases) || !peak || interval.count() <= 0)
+	{
+		std::fprintf(stderr, "usage: %s [seconds] [live objects] [name:seconds,...] [sample interval ms]\n", argv[0]);
+		return 1;
+	}
+
+	std::printf("allocator,seconds,phase,live_objects,rss_bytes,mapped_bytes,segments,fragmentation\n");
+	bool ok = soak_in_child<pool_allocator>(phases, duration, peak, interval);
+	ok &= soak_in_child<malloc_allocator>(phases, duration, peak, interval);
+
+	return ok ? 0 : 1;
+}
@@ -1,424 +1,799 @@
-#include <iostream>
-#include <mutex>
-#include <list>
-#include <sys/mman.h>
-#include <sys/user.h>
-#include <cassert>
-#include <utility>
+#include "memory_pool.h"
+#include "io_buffer_pool.h"
+#include "persistent_pool.h"
+#include "shared_memory_pool.h"
+#include "fork_friendly_pool.h"
+#include "flat_combining_pool.h"
+#include "flex_pool.h"
+#include "pool_ptr.h"
 
+class object
+{
+private:
+	unsigned long a;
+	unsigned long b;
+	unsigned long c;
+};
 
-#define OBJECT_POOL_ALLOCATE_WARM_CACHE
-#define OBJECT_CANARY				0xcacacacacacacaca
-#undef OBJECT_CANARY
-#undef OBJECT_POOL_DEFER_UNMAP
+struct alignas(64) cacheline_counter
+{
+	unsigned long count;
+};
 
-static constexpr size_t object_pool_alignment = 16UL;
+struct kilobyte_object
+{
+	unsigned char data[1000];
+};
 
-template <typename T>
-constexpr T align_up(T number, T alignment)
+struct alignas(64) aligned_block
 {
-	return (number + (alignment - 1)) & -alignment;
-}
+	unsigned char data[128];
+};
+
+struct message_header
+{
+	unsigned short length;
+};
 
+/* A binary tree whose nodes destroy their children asynchronously */
+struct tree_node
+{
+	tree_node *left, *right;
+	static inline std::atomic<size_t> destroyed;
 
-template <typename T>
-class memory_pool_segment;
+	~tree_node();
+};
 
-template <typename T>
-struct memory_chunk
+static memory_pool<tree_node> *tree_pool_ptr;
+
+tree_node::~tree_node()
 {
-	struct memory_chunk *next;
-	memory_pool_segment<T> *segment;
-#ifdef OBJECT_CANARY
-	unsigned long object_canary;
-	unsigned long pad0;
-#endif
-	/* Note that this is 16-byte aligned */
-} __attribute__((packed));
+	destroyed++;
+	if(left)
+		tree_pool_ptr->destroy_async(left);
+	if(right)
+		tree_pool_ptr->destroy_async(right);
+}
 
-template <typename T>
-class memory_pool_segment
+static tree_node *build_tree(memory_pool<tree_node> &pool, int depth)
 {
-private:
-	void *mmap_segment;
-	size_t size;
-public:
-	size_t used_objs;
-	memory_pool_segment<T> *prev, *next;
-
-	memory_pool_segment(void *mmap_segment, size_t size) : mmap_segment{mmap_segment}, size{size}, used_objs{},
-								prev{nullptr}, next{nullptr} {}
-	~memory_pool_segment()
-	{
-		/* If mmap_segment is null, it's an empty object(has been std::move'd) */
-		if(mmap_segment != nullptr)
-		{
-			assert(used_objs == 0);
-			//std::cout << "Freeing segment " << mmap_segment << "\n";
-			munmap(mmap_segment, size);
-		}
+	auto node = new (pool.allocate()) tree_node{};
+	if(depth > 0)
+	{
+		node->left = build_tree(pool, depth - 1);
+		node->right = build_tree(pool, depth - 1);
 	}
 
-	memory_pool_segment(const memory_pool_segment &rhs) = delete;
-	memory_pool_segment& operator=(const memory_pool_segment &rhs) = delete;
+	return node;
+}
 
-	memory_pool_segment(memory_pool_segment&& rhs)
-	{
-		if(this == &rhs)
-			return;
-		mmap_segment = rhs.mmap_segment;
-		size = rhs.size;
-		used_objs = rhs.used_objs;
+#include <deque>
+#include <vector>
+#include <thread>
+#include <sys/wait.h>
 
-		rhs.mmap_segment = nullptr;
-		rhs.size = SIZE_MAX;
-		rhs.used_objs = 0;
-	}
+int main(int argc, char **)
+{
+	memory_pool<object> pool;
+	/* TODO: Why is pool going out of scope */
+	/* TODO: Add support for buffers bigger than 2 * PAGE_SIZE and adjust segment size dynamically */
+	std::vector<object *> vec;
 
-	memory_pool_segment& operator=(memory_pool_segment&& rhs)
+	for(int i = 0; i < 10000; i++)
 	{
-		if(this == &rhs)
-			return *this;
-		mmap_segment = rhs.mmap_segment;
-		size = rhs.size;
-		used_objs = rhs.used_objs;
+		auto p = pool.allocate();
+		vec.push_back(p);
+		//std::cout << "Allocated " << p << "\n";
+	}
 
-		rhs.mmap_segment = nullptr;
-		rhs.size = SIZE_MAX;
-		rhs.used_objs = 0;
+	/* Recycled chunks need to come back zeroed as well */
+	auto z = pool.allocate_zeroed();
+	memset(static_cast<void *>(z), 0xff, sizeof(*z));
+	pool.free(z);
+	z = pool.allocate_zeroed();
+	for(size_t i = 0; i < sizeof(*z); i++)
+		assert(reinterpret_cast<unsigned char *>(z)[i] == 0);
+	pool.free(z);
 
-		return *this;
+	for(auto &p : vec)
+	{
+		pool.free(p);
+		p = nullptr;
 	}
 
-	static constexpr bool is_large_object()
+	pool.purge();
+
+	/* Incremental purging, the way an event loop's idle hook would do it: at
+	 * most 4 segments per call, done once there are none left */
+	memory_pool_tunables caching;
+	caching.empty_segments = 64;
+	caching.stats = true;
+	memory_pool<object> purge_pool{caching};
+	auto purge_per_segment = memory_pool_segment<object>::number_of_objects(purge_pool.get_tunables().segment_size);
+	std::vector<object *> to_purge;
+	for(size_t i = 0; i < 20 * purge_per_segment; i++)
+		to_purge.push_back(purge_pool.allocate());
+	for(auto o : to_purge)
+		purge_pool.free(o);
+	assert(purge_pool.usage().empty_segments == 20);
+
+	[[maybe_unused]] size_t purged = 0;
+	bool purge_done;
+	do
+	{
+		purge_done = purge_pool.purge(size_t{4});
+		auto unmapped = purge_pool.stats().segments_unmapped;
+		assert(unmapped - purged <= 4);
+		assert(purge_done == (purge_pool.usage().segments == 0));
+		purged = unmapped;
+	} while(!purge_done);
+	assert(purged == 20);
+
+	/* Pages with no live objects on them get released, and come back on reuse */
+	memory_pool<kilobyte_object> release_pool;
+	std::vector<kilobyte_object *> kbs;
+	for(int i = 0; i < 240; i++)
 	{
-		return sizeof(T) >= PAGE_SIZE / 8;
+		kbs.push_back(release_pool.allocate());
+		memset(kbs.back()->data, i, sizeof(kbs.back()->data));
 	}
-	
-	static constexpr size_t default_pool_size = 2 * PAGE_SIZE;
 
-	static constexpr size_t size_of_chunk()
+	for(int i = 0; i < 240; i++)
 	{
-		return align_up(sizeof(T), object_pool_alignment) + sizeof(memory_chunk<T>);
+		if(i % 24 != 0)
+			release_pool.free(kbs[i]);
 	}
 
-	static constexpr size_t size_of_inline_segment()
+	assert(release_pool.release_free_pages() > 0);
+	for(int i = 0; i < 240; i += 24)
+		assert(kbs[i]->data[0] == i && kbs[i]->data[sizeof(kbs[i]->data) - 1] == i);
+
+	for(int i = 0; i < 240; i++)
 	{
-		return align_up(sizeof(memory_pool_segment<T>), object_pool_alignment);
+		if(i % 24 != 0)
+			kbs[i] = release_pool.allocate();
 	}
 
-	static constexpr size_t memory_pool_size()
+	for(auto kb : kbs)
+		release_pool.free(kb);
+
+	/* In big segments the page map spans several pages, none of which gets released */
+	memory_pool_tunables big_segment;
+	big_segment.segment_size = 32 * 1024 * 1024;
+	memory_pool<object> big_pool{big_segment};
+	std::vector<object *> big;
+	for(int i = 0; i < 250000; i++)
 	{
-		if(is_large_object())
-		{
-			return align_up(size_of_inline_segment() + size_of_chunk() * 24, PAGE_SIZE); 
-		}
-		else
-			return default_pool_size;
+		big.push_back(big_pool.allocate());
+		*reinterpret_cast<unsigned long *>(big.back()) = i;
 	}
 
-	constexpr size_t number_of_objects()
+	big_pool.free(big.back());
+	big.pop_back();
+	big_pool.release_free_pages();
+	big_pool.release_free_pages();
+
+	auto big_seg = (reinterpret_cast<memory_chunk<object> *>(big[0]) - 1)->segment;
+	assert(big_seg->header_pages() > 1);
+	for(size_t p = 0; p < big_seg->header_pages(); p++)
+		assert(big_seg->page_used[p] != big_seg->page_released);
+	for(size_t i = 0; i < big.size(); i++)
 	{
-		return (memory_pool_size() - size_of_inline_segment()) / size_of_chunk();
+		assert(*reinterpret_cast<unsigned long *>(big[i]) == i);
+		big_pool.free(big[i]);
 	}
 
-	std::pair<memory_chunk<T> *, memory_chunk<T> *> setup_chunks()
+	/* Reclaim under memory pressure runs user shrinkers and every pool */
+	auto &registry = pool_registry::instance();
+	bool shrunk = false;
+	auto shrinker = registry.register_shrinker([&]()
 	{
-		memory_chunk<T> *prev = nullptr;
-		memory_chunk<T> *curr = reinterpret_cast<memory_chunk<T> *>((unsigned char *) mmap_segment + size_of_inline_segment());
-		auto first = curr;
-		auto nr_objs = number_of_objects();
+		shrunk = true;
+		return size_t{0};
+	});
+	registry.reclaim();
+	assert(shrunk);
+	registry.unregister_shrinker(shrinker);
+	[[maybe_unused]] bool monitoring = registry.start_monitor();
+	assert(monitoring);
+	registry.stop_monitor();
+
+	/* Two pools sharing a group budget: allocation fails at the group's hard limit */
+	constexpr auto kb_segment = memory_pool_segment<kilobyte_object, default_object_alignment<kilobyte_object>()>::memory_pool_size();
+	constexpr auto kb_per_segment = memory_pool_segment<kilobyte_object, default_object_alignment<kilobyte_object>()>::number_of_objects(kb_segment);
+	pool_budget group{2 * kb_segment, 3 * kb_segment};
+	pool_budget own{SIZE_MAX, SIZE_MAX, &group};
+	memory_pool<kilobyte_object> budget_pool_a, budget_pool_b;
+	budget_pool_a.set_budget(&own);
+	budget_pool_b.set_budget(&group);
+
+	std::vector<kilobyte_object *> budgeted_a, budgeted_b;
+	for(size_t i = 0; i < 2 * kb_per_segment; i++)
+		budgeted_a.push_back(budget_pool_a.allocate());
+	for(size_t i = 0; i < kb_per_segment; i++)
+		budgeted_b.push_back(budget_pool_b.allocate());
+	assert(group.usage() == 3 * kb_segment && own.usage() == 2 * kb_segment);
+	assert(group.over_soft_limit() && own.over_soft_limit());
+	assert(!budget_pool_a.allocate() && !budget_pool_b.allocate());
+
+	for(auto kb : budgeted_a)
+		budget_pool_a.free(kb);
+	for(auto kb : budgeted_b)
+		budget_pool_b.free(kb);
+	budget_pool_a.purge();
+	budget_pool_b.purge();
+	assert(!group.over_soft_limit());
+
+	/* Runtime tunables: bigger segments, one cached empty segment and stats */
+	memory_pool_tunables tunables;
+	[[maybe_unused]] bool parsed_bad = tunables.parse("segment_size=65536,bogus=1");
+	[[maybe_unused]] bool parsed = tunables.parse("empty_segments=1,purge_delay_ms=3600000,stats=1,numa=local");
+	assert(!parsed_bad && parsed);
+	assert(tunables.segment_size == 65536 && tunables.empty_segments == 1 && tunables.stats);
+	setenv("MEMORY_POOL_CONFIG", "huge_pages=1,numa=interleave", 1);
+	assert(memory_pool_tunables::from_env().huge_pages);
+	unsetenv("MEMORY_POOL_CONFIG");
+
+	memory_pool<object> tuned_pool{tunables};
+	auto per_segment = memory_pool_segment<object>::number_of_objects(tuned_pool.get_tunables().segment_size);
+	std::vector<object *> tuned;
+	for(size_t i = 0; i < 3 * per_segment; i++)
+		tuned.push_back(tuned_pool.allocate());
+	[[maybe_unused]] auto usage = tuned_pool.usage();
+	assert(usage.segments == 3 && usage.empty_segments == 0 && usage.live_objects == 3 * per_segment);
+	assert(usage.mapped_bytes == 3 * tuned_pool.get_tunables().segment_size);
+	for(auto o : tuned)
+		tuned_pool.free(o);
 
-		while(nr_objs--)
-		{
-			curr->segment = this;
-#ifdef OBJECT_CANARY
-			curr->object_canary = OBJECT_CANARY;
+#ifndef OBJECT_POOL_DEFER_UNMAP
+	size_t unmapped_on_free = 2;
+#else
+	size_t unmapped_on_free = 0;
 #endif
-			curr->next = nullptr;
-			if(prev)	prev->next = curr;
-
-			prev = curr;
-			curr = reinterpret_cast<memory_chunk<T> *>(reinterpret_cast<unsigned char *>(curr) + size_of_chunk());
-		}
-
-		return std::pair<memory_chunk<T> *, memory_chunk<T> *>(first, prev);
-	}
-
-	bool empty()
+	auto stats = tuned_pool.stats();
+	assert(stats.segments_mapped == 3 && stats.segments_unmapped == unmapped_on_free);
+	/* The cached segments haven't been empty for long enough to be purged */
+	tuned_pool.purge();
+	assert(tuned_pool.stats().segments_unmapped == unmapped_on_free);
+	tuned_pool.reclaim();
+	assert(tuned_pool.stats().segments_unmapped == 3);
+
+	/* Self-tuning: a pool that keeps unmapping and remapping a segment starts
+	 * caching empty segments, and one that grows quickly gets bigger segments.
+	 * The interval is long enough to never pass here, tune_now() decides. */
+	memory_pool_tunables self_tuned;
+	self_tuned.self_tune = true;
+	self_tuned.stats = true;
+	self_tuned.tune_interval = std::chrono::hours{1};
+	memory_pool<object> churn_pool{self_tuned};
+	auto churn_per_segment = memory_pool_segment<object>::number_of_objects(churn_pool.get_tunables().segment_size);
+	for(int round = 0; round < 4; round++)
 	{
-		return used_objs == 0;
+		std::vector<object *> objs;
+		for(size_t i = 0; i < churn_per_segment; i++)
+			objs.push_back(churn_pool.allocate());
+		for(auto o : objs)
+			churn_pool.free(o);
 	}
+	assert(churn_pool.get_tunables().empty_segments == 0);
+	churn_pool.tune_now();
+#ifndef OBJECT_POOL_DEFER_UNMAP
+	assert(churn_pool.get_tunables().empty_segments > 0);
+#endif
 
-	bool operator==(const memory_pool_segment<T> &rhs)
+	memory_pool<object> growing_pool{self_tuned};
+	auto base_size = growing_pool.get_tunables().segment_size;
+	std::vector<object *> grown;
+	for(size_t i = 0; i < 8 * churn_per_segment; i++)
+		grown.push_back(growing_pool.allocate());
+	assert(growing_pool.get_tunables().segment_size == base_size);
+	growing_pool.tune_now();
+	assert(growing_pool.get_tunables().segment_size > base_size);
+	assert(growing_pool.stats().tuning_decisions > 0);
+	for(auto o : grown)
+		growing_pool.free(o);
+
+	/* Growing in place: the pool stays in one segment until it hits max_segment_size */
+	memory_pool_tunables grow_tunables;
+	grow_tunables.grow_in_place = true;
+	grow_tunables.stats = true;
+	grow_tunables.max_segment_size = 256 * 1024;
+	memory_pool<object> grow_pool{grow_tunables};
+	std::vector<object *> grown_in_place;
+	for(int i = 0; i < 10000; i++)
 	{
-		return mmap_segment == rhs.mmap_segment;
+		auto o = grow_pool.allocate();
+		assert(grow_pool.owns(o));
+		*reinterpret_cast<unsigned long *>(o) = i;
+		grown_in_place.push_back(o);
 	}
 
-	void *get_mmap_segment()
+	auto grow_stats = grow_pool.stats();
+	assert(grow_stats.segments_grown > 0);
+	assert(grow_stats.segments_mapped <= 3);
+	for(int i = 0; i < 10000; i++)
 	{
-		return mmap_segment;
+		assert(*reinterpret_cast<unsigned long *>(grown_in_place[i]) == static_cast<unsigned long>(i));
+		grow_pool.free(grown_in_place[i]);
 	}
-};
-
-template <typename T>
-class memory_pool
-{
-private:
-	memory_chunk<T> *free_chunk_head, *free_chunk_tail;
-	std::mutex lock;
-	memory_pool_segment<T> *segment_head, *segment_tail;
-	size_t nr_objects;
 
-	void append_segment(memory_pool_segment<T> *seg)
+	/* Packed layouts: no chunk crosses a page, or a cache line */
+	for(auto [layout, unit] : {std::pair{chunk_layout::page, PAGE_SIZE}, std::pair{chunk_layout::cache_line, cache_line_size}})
 	{
-		if(!segment_head)
-		{
-			segment_head = segment_tail = seg;
-		}
-		else
+		memory_pool_tunables packed;
+		packed.layout = layout;
+		packed.segment_size = 64 * 1024;
+		memory_pool<object> packed_pool{packed};
+		std::vector<object *> objs;
+		for(int i = 0; i < 10000; i++)
 		{
-			segment_tail->next = seg;
-			seg->prev = segment_tail;
-			segment_tail = seg;
+			auto o = packed_pool.allocate();
+			[[maybe_unused]] auto start = reinterpret_cast<unsigned long>(o) - sizeof(memory_chunk<object>);
+			assert(start / unit == (reinterpret_cast<unsigned long>(o + 1) - 1) / unit);
+			assert(packed_pool.owns(o) && !packed_pool.owns(reinterpret_cast<unsigned char *>(o) + 16));
+			objs.push_back(o);
 		}
+
+		for(auto o : objs)
+			packed_pool.free(o);
 	}
 
-	void remove_segment(memory_pool_segment<T> *seg)
+	/* The page map finds the pool of any object, and rejects everything else */
+	memory_pool<object> owner_pool;
+	memory_pool<kilobyte_object> other_owner_pool;
+	auto owned = owner_pool.allocate();
+	auto other_owned = other_owner_pool.allocate();
+	object on_stack;
+	auto foreign = new object;
+	assert(owner_pool.owns(owned) && !owner_pool.owns(other_owned));
+	assert(!owner_pool.owns(&on_stack) && !owner_pool.owns(foreign) && !owner_pool.owns(nullptr));
+	assert(!owner_pool.owns(reinterpret_cast<unsigned char *>(owned) + 8));
+	assert(!pool_free(foreign) && !pool_free(&on_stack));
+	[[maybe_unused]] bool freed_owned = pool_free(owned);
+	[[maybe_unused]] bool freed_other = pool_free(other_owned);
+	assert(freed_owned && freed_other);
+	assert(owner_pool.used_objects == 0 && other_owner_pool.used_objects == 0);
+	delete foreign;
+
+#ifdef OBJECT_POOL_SAMPLED_HARDENING
+	/* Sampled hardening: every allocation sampled, into guard page slots
+	 * while there are free ones, and canaries plus quarantine after that */
+	memory_pool_tunables hardened;
+	hardened.sample_rate = 1;
+	hardened.guarded_slots = 4;
+	memory_pool<object> hardened_pool{hardened};
+	std::vector<object *> sampled;
+	for(int i = 0; i < 1000; i++)
 	{
-		if(seg->prev)
+		auto o = hardened_pool.allocate_zeroed();
+		assert(hardened_pool.owns(o) && *reinterpret_cast<unsigned long *>(o) == 0);
+		*reinterpret_cast<unsigned long *>(o) = i;
+		sampled.push_back(o);
+	}
+	for(auto o : sampled)
+	{
+		[[maybe_unused]] bool freed = pool_free(o);
+		assert(freed);
+	}
+	assert(hardened_pool.used_objects == 0);
+	for(auto &o : sampled)
+		o = hardened_pool.allocate();
+	hardened_pool.free(sampled.data(), sampled.size());
+	assert(hardened_pool.used_objects == 0);
+	hardened_pool.reclaim();
+
+	/* Runs fn in a child and tells whether it died */
+	auto dies = [](auto fn)
+	{
+		if(fork() == 0)
 		{
-			seg->prev->next = seg->next;
+			int null = open("/dev/null", O_WRONLY);
+			dup2(null, STDERR_FILENO);
+			fn();
+			_exit(0);
 		}
-		else
-			segment_head = seg->next;
-		
-		if(seg->next)
-			seg->next->prev = seg->prev;
-		else
-			segment_tail = seg->prev;
 
-		seg->~memory_pool_segment<T>();
+		int status;
+		wait(&status);
+		return !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+	};
+
+	auto past_end = [](object *o) { return reinterpret_cast<unsigned char *>(o) + align_up(sizeof(object), object_pool_alignment); };
+	assert(!dies([&]() { hardened_pool.free(hardened_pool.allocate()); }));
+	/* Overflow into the guard page, and use after free of a guarded object */
+	assert(dies([&]() { *past_end(hardened_pool.allocate()) = 1; }));
+	assert(dies([&]() { auto o = hardened_pool.allocate(); hardened_pool.free(o); *reinterpret_cast<unsigned long *>(o) = 1; }));
+
+	hardened.guarded_slots = 0;
+	memory_pool<object> canary_pool{hardened};
+	/* Overflow into the padding, use after free of a quarantined object, double free */
+	assert(dies([&]() { auto o = canary_pool.allocate(); *reinterpret_cast<unsigned char *>(o + 1) = 1; canary_pool.free(o); }));
+	assert(dies([&]() { auto o = canary_pool.allocate(); canary_pool.free(o); *reinterpret_cast<unsigned long *>(o) = 1; canary_pool.reclaim(); }));
+	assert(dies([&]() { auto o = canary_pool.allocate(); canary_pool.free(o); canary_pool.free(o); }));
+
+	/* Over-aligned objects can end right at a page boundary, with their
+	 * canary on the next page, which mustn't get released under them */
+	auto aligned_tunables = hardened;
+	aligned_tunables.segment_size = 64 * 1024;
+	memory_pool<aligned_block> aligned_sampled_pool{aligned_tunables};
+	std::vector<aligned_block *> blocks, page_end_blocks;
+	for(int i = 0; i < 1000; i++)
+		blocks.push_back(aligned_sampled_pool.allocate());
+	for(auto b : blocks)
+	{
+		if(reinterpret_cast<uintptr_t>(b + 1) % PAGE_SIZE == 0)
+			page_end_blocks.push_back(b);
+		else
+			aligned_sampled_pool.free(b);
 	}
-
-	bool expand_pool()
+	assert(!page_end_blocks.empty());
+	aligned_sampled_pool.release_free_pages();
+	for(auto b : page_end_blocks)
 	{
-		//std::cout << "Expanding pool.\n";
-		auto allocation_size = memory_pool_segment<T>::memory_pool_size();
-		void *new_mmap_region = mmap(nullptr, allocation_size, PROT_WRITE | PROT_READ, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
-		if(!new_mmap_region)
-			return false;
-
-		memory_pool_segment<T> seg{new_mmap_region, allocation_size};
-
-		nr_objects += seg.number_of_objects();
-
-		//std::cout << "Added " << new_mmap_region << " size " << allocation_size << "\n";
-	
-		memory_pool_segment<T> &mmap_seg = *static_cast<memory_pool_segment<T> *>(new_mmap_region);
-		mmap_seg = std::move(seg);
-
-		auto pair = mmap_seg.setup_chunks();
-		free_chunk_head = pair.first;
-		free_chunk_tail = pair.second;
+		auto seg = (reinterpret_cast<memory_chunk<aligned_block> *>(b) - 1)->segment;
+		auto page = (reinterpret_cast<unsigned char *>(b + 1) - static_cast<unsigned char *>(seg->get_mmap_segment())) / PAGE_SIZE;
+		assert(seg->page_used[page] != seg->page_released);
+		aligned_sampled_pool.free(b);
+	}
 
-		append_segment(&mmap_seg);
+	/* Recycled sampled chunks get zeroed without losing their canary */
+	std::vector<object *> recycled;
+	for(int i = 0; i < 64; i++)
+		recycled.push_back(canary_pool.allocate());
+	for(auto o : recycled)
+		canary_pool.free(o);
+	for(auto &o : recycled)
+		o = canary_pool.allocate_zeroed();
+	for(auto o : recycled)
+		canary_pool.free(o);
+	assert(canary_pool.used_objects == 0);
+#endif
 
-		return true;
+	/* Smart pointers: the deleter finds the pool, and shared pointers count
+	 * references inside the chunk */
+	static_assert(sizeof(pool_unique_ptr<object>) == sizeof(object *));
+	static_assert(sizeof(pool_shared_ptr<tree_node>) == sizeof(tree_node *));
+	memory_pool<tree_node> unique_pool;
+	tree_pool_ptr = &unique_pool;
+	tree_node::destroyed = 0;
+	{
+		auto u = make_pool_unique(unique_pool);
+		auto moved = std::move(u);
+		assert(!u && moved && unique_pool.used_objects == 1);
 	}
+	assert(unique_pool.used_objects == 0 && tree_node::destroyed == 1);
 
-	inline memory_chunk<T> *ptr_to_chunk(T *ptr)
+	shared_object_pool<tree_node> shared_pool;
+	shared_object_pool<unsigned long, false> local_pool;
 	{
-		/* Memory is layed out like this:
-		 * ----------------------------------
-		 * memory_chunk<T>
-		 * ..................................
-		 * T data
-		 * ..................................
-		 * Possible padding in between chunks
-		 * ----------------------------------*/
-
-		memory_chunk<T> *c = reinterpret_cast<memory_chunk<T> *>(ptr) - 1;
-		return c;
+		auto s = make_pool_shared(shared_pool);
+		auto copy = s;
+		pool_shared_ptr<tree_node> moved{std::move(copy)};
+		assert(s == moved && s.use_count() == 2 && !copy);
+		s.reset();
+		assert(moved.use_count() == 1 && tree_node::destroyed == 1);
+
+		auto l = make_pool_shared(local_pool, 42UL);
+		auto l2 = l;
+		assert(*l2 == 42 && l.use_count() == 2);
 	}
-
-	void free_list_purge_segment_chunks(memory_pool_segment<T> *seg)
+	assert(shared_pool.used_objects == 0 && local_pool.used_objects == 0 && tree_node::destroyed == 2);
+
+	/* Reserved capacity: a pool at its hard limit still serves critical
+	 * allocations, and frees refill the reserve before anything else */
+	memory_pool_tunables reserving;
+	reserving.segment_size = 65536;
+	reserving.reserved_objects = 4;
+	reserving.stats = true;
+	pool_budget one_segment{SIZE_MAX, reserving.segment_size};
+	memory_pool<object> reserve_pool{reserving};
+	reserve_pool.set_budget(&one_segment);
+	std::vector<object *> ordinary, critical;
+	while(auto o = reserve_pool.allocate())
+		ordinary.push_back(o);
+	assert(reserve_pool.usage().reserved_objects == 4);
+	for(int i = 0; i < 4; i++)
+		critical.push_back(reserve_pool.allocate_critical());
+	assert(!reserve_pool.allocate_critical() && reserve_pool.stats().critical_allocations == 4);
+	reserve_pool.free(ordinary.back());
+	ordinary.pop_back();
+	assert(!reserve_pool.allocate() && reserve_pool.usage().reserved_objects == 1);
+	critical.push_back(reserve_pool.allocate_critical());
+	assert(critical.back() && reserve_pool.used_objects == ordinary.size() + critical.size());
+	for(auto o : ordinary)
+		reserve_pool.free(o);
+	for(auto o : critical)
+		reserve_pool.free(o);
+	assert(reserve_pool.usage().reserved_objects == 4);
+
+	/* Refills stay in the segment the reserve already pins, so they don't
+	 * keep the other segments around */
+	pool_budget three_segments{SIZE_MAX, 3 * reserving.segment_size};
+	memory_pool<object> spread_pool{reserving};
+	spread_pool.set_budget(&three_segments);
+	std::deque<object *> spread;
+	while(auto o = spread_pool.allocate())
+		spread.push_back(o);
+	for(int i = 0; i < 4; i++)
+		critical[i] = spread_pool.allocate_critical();
+	/* Alternate between the first and the last segment */
+	for(int i = 0; i < 4; i++)
 	{
-		//std::cout << "Removing chunks\n";
-		auto l = free_chunk_head;
-		memory_chunk<T> *prev = nullptr;
-		while(l)
-		{
-			//std::cout << "Hello " << l << "\n";
-			if(l->segment == seg)
-			{
-				//std::cout << "Removing chunk " << l << "\n";
-				if(prev)
-					prev->next = l->next;
-				else
-					free_chunk_head = l->next;
-				
-				if(!l->next)
-					free_chunk_tail = prev;
-			}
-
-			l = l->next;
-		}
+		spread_pool.free(spread.back());
+		spread.pop_back();
+		spread_pool.free(spread.front());
+		spread.pop_front();
 	}
-
-	void append_chunk_tail(memory_chunk<T> *chunk)
+	assert(spread_pool.usage().reserved_objects == 4);
+	for(auto o : spread)
+		spread_pool.free(o);
+	for(int i = 0; i < 4; i++)
+		spread_pool.free(critical[i]);
+	spread_pool.purge();
+	assert(spread_pool.usage().segments == 1);
+
+	/* A header plus a trailing array, freed without its length */
+	flex_pool<message_header, unsigned long, 1000> flex;
+	std::vector<message_header *> messages;
+	for(unsigned short n = 0; n <= 1000; n++)
 	{
-		if(!free_chunk_tail)
-		{
-			free_chunk_head = free_chunk_tail = chunk;
-		}
-		else
-		{
-			free_chunk_tail->next = chunk;
-			free_chunk_tail = chunk;
-			assert(free_chunk_head != nullptr);
-		}
+		auto m = flex.allocate(n);
+		assert(reinterpret_cast<uintptr_t>(m) % alignof(unsigned long) == 0);
+		assert(flex.capacity(n) >= n && flex.capacity(n) <= size_t{n} + n / 4 + 1);
+		m->length = n;
+		for(unsigned short i = 0; i < n; i++)
+			flex.elements(m)[i] = n;
+		messages.push_back(m);
 	}
-
-	void append_chunk_head(memory_chunk<T> *chunk)
+	assert(!flex.allocate(1001) && flex.used_objects() == 1001);
+	for(auto m : messages)
 	{
-		if(!free_chunk_head)
-		{
-			free_chunk_head = free_chunk_tail = chunk;
-		}
-		else
-		{
-			auto curr_head = free_chunk_head;
-			free_chunk_head = chunk;
-			free_chunk_head->next = curr_head;
-			assert(free_chunk_tail != nullptr);
-		}
+		for(unsigned short i = 0; i < m->length; i++)
+			assert(flex.elements(m)[i] == m->length);
+		flex.free(m);
 	}
+	assert(flex.used_objects() == 0);
 
-	void purge_segment(memory_pool_segment<T> *segment)
+	/* Over-aligned types, and an explicit alignment up to PAGE_SIZE */
+	memory_pool<cacheline_counter> counter_pool;
+	memory_pool<object, PAGE_SIZE> page_pool;
+	std::vector<cacheline_counter *> counters;
+	for(int i = 0; i < 1000; i++)
 	{
-		if(segment->empty())
-		{
-			/* We can still have free objects on the free list. Remove them. */
-			free_list_purge_segment_chunks(segment);
-			remove_segment(segment);
-		}
+		auto c = counter_pool.allocate();
+		assert(reinterpret_cast<unsigned long>(c) % alignof(cacheline_counter) == 0);
+		counters.push_back(c);
 	}
 
-public:
-	size_t used_objects;
+	for(auto c : counters)
+		counter_pool.free(c);
 
-	memory_pool() : free_chunk_head{nullptr}, free_chunk_tail{nullptr}, lock{}, segment_head{}, segment_tail{},
-			nr_objects{0}, used_objects{0} {}
+	auto page_obj = page_pool.allocate();
+	assert(reinterpret_cast<unsigned long>(page_obj) % PAGE_SIZE == 0);
+	page_pool.free(page_obj);
 
-	void print_segments()
+	/* Page-aligned I/O buffers, registered as fixed buffers when io_uring is around */
+	io_buffer_pool io_pool{PAGE_SIZE, 4 * PAGE_SIZE};
+	io_uring_params params{};
+	int ring = syscall(__NR_io_uring_setup, 8, &params);
+	if(ring >= 0)
 	{
+		[[maybe_unused]] auto registered = io_pool.register_buffers(ring);
+		assert(registered == 0);
 	}
 
-	~memory_pool()
+	std::vector<void *> bufs;
+	for(int i = 0; i < 16; i++)
 	{
-		assert(used_objects == 0);
+		auto b = io_pool.allocate();
+		assert(reinterpret_cast<unsigned long>(b) % PAGE_SIZE == 0);
+		assert(io_pool.buffer_index(b) == (ring >= 0 ? i / 4 : -1));
+		bufs.push_back(b);
 	}
 
-	T *allocate()
+	/* Completions can hand buffers back from any thread */
+	std::thread completer{[&]()
 	{
-		std::scoped_lock guard{lock};
-
-		while(!free_chunk_head)
-		{
-			if(!expand_pool())
-			{
-				//std::cout << "mmap failed\n";
-				return nullptr;
-			}
-		}
-
-		auto return_chunk = free_chunk_head;
-
-		free_chunk_head = free_chunk_head->next;
+		for(auto b : bufs)
+			io_pool.free(b);
+	}};
+	completer.join();
 
-		if(!free_chunk_head)	free_chunk_tail = nullptr;
-
-		return_chunk->segment->used_objs++;
-		used_objects++;
-
-#ifdef OBJECT_CANARY
-		assert(return_chunk->object_canary == OBJECT_CANARY);
-#endif
+	if(ring >= 0)
+	{
+		assert(io_pool.registration_error() == 0);
+		io_pool.unregister_buffers();
+		assert(io_pool.buffer_index(bufs[0]) == -1);
+		close(ring);
+	}
 
-		return reinterpret_cast<T *>(return_chunk + 1);
+	/* Persistent objects are still there after closing and reopening the pool */
+	char path[] = "/tmp/memory_pool_testXXXXXX";
+	close(mkstemp(path));
+	{
+		auto ppool = persistent_pool<unsigned long>::open(path);
+		assert(ppool);
+		auto v = ppool->allocate();
+		*v = 0xdeadbeef;
+		ppool->set_root(v);
 	}
 
-	void free(T *ptr)
 	{
-		auto chunk = ptr_to_chunk(ptr);
-		//std::cout << "Removing chunk " << chunk << "\n";
-		std::scoped_lock guard{lock};
+		auto ppool = persistent_pool<unsigned long>::open(path);
+		assert(ppool && !ppool->recovered());
+		assert(*ppool->root() == 0xdeadbeef);
+		assert(ppool->used_objects() == 1);
+	}
 
-		chunk->next = nullptr;
-#ifdef OBJECT_CANARY
-		assert(chunk->object_canary == OBJECT_CANARY);
-#endif
+	/* A process that dies with the pool open forces a rebuild on the next open */
+	if(fork() == 0)
+	{
+		auto ppool = persistent_pool<unsigned long>::open(path);
+		*ppool->allocate() = 1;
+		_exit(0);
+	}
+	wait(nullptr);
 
-#ifndef OBJECT_POOL_ALLOCATE_WARM_CACHE
-		append_chunk_tail(chunk);
-#else
-		append_chunk_head(chunk);
-#endif
+	{
+		auto ppool = persistent_pool<unsigned long>::open(path);
+		assert(ppool && ppool->recovered());
+		assert(*ppool->root() == 0xdeadbeef);
+		assert(ppool->used_objects() == 2);
+	}
+	unlink(path);
+
+	/* Objects handed over between processes through shared memory */
+	auto shm_pool = shared_memory_pool<unsigned long>::create(1000);
+	assert(shm_pool);
+	/* The child has to record its own pid, not the one we cached here */
+	shm_pool->free(shm_pool->allocate());
+	int handoff[2];
+	[[maybe_unused]] auto piped = pipe(handoff);
+	assert(piped == 0);
+	if(fork() == 0)
+	{
+		auto v = shm_pool->allocate();
+		*v = 0xcafe;
+		shm_pool->transfer(v, getppid());
+		auto off = shm_pool->offset_of(v);
+		/* This one dies with us and has to be recovered */
+		shm_pool->allocate();
+		if(write(handoff[1], &off, sizeof(off)) != sizeof(off))
+			_exit(1);
+		_exit(0);
+	}
+	wait(nullptr);
+
+	uint64_t off;
+	[[maybe_unused]] auto handed = read(handoff[0], &off, sizeof(off));
+	assert(handed == sizeof(off));
+	close(handoff[0]);
+	close(handoff[1]);
+	auto shared = shm_pool->at(off);
+	assert(*shared == 0xcafe);
+	[[maybe_unused]] auto recovered = shm_pool->recover();
+	assert(recovered == 1);
+	shm_pool->free(shared);
+	assert(shm_pool->used_objects() == 0);
+
+	/* Every chunk can be taken again once freed, and none twice */
+	std::vector<unsigned long *> shm_objs;
+	for(int round = 0; round < 2; round++)
+	{
+		while(auto v = shm_pool->allocate())
+			shm_objs.push_back(v);
+		assert(shm_objs.size() == 1000);
+		std::sort(shm_objs.begin(), shm_objs.end());
+		assert(std::adjacent_find(shm_objs.begin(), shm_objs.end()) == shm_objs.end());
+		for(auto v : shm_objs)
+			shm_pool->free(v);
+		shm_objs.clear();
+	}
+	assert(shm_pool->used_objects() == 0);
 
-		used_objects--;
-		chunk->segment->used_objs--;
+	/* Pools with out-of-band metadata work the same on both sides of a fork */
+	fork_friendly_pool<object> ff_pool;
+	for(int i = 0; i < 10000; i++)
+		vec[i] = ff_pool.allocate();
 
-#ifndef OBJECT_POOL_DEFER_UNMAP
-		purge_segment(chunk->segment);
-#endif
+	if(fork() == 0)
+	{
+		for(auto &p : vec)
+			ff_pool.free(p);
+		assert(ff_pool.used_objects == 0);
+		_exit(0);
 	}
+	int status;
+	wait(&status);
+	assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
 
-
-	void purge()
+	for(auto &p : vec)
 	{
-		auto s = segment_head;
+		ff_pool.free(p);
+		p = nullptr;
+	}
 
-		while(s)
+	/* Combined operations from several threads, with reclaim going on in the
+	 * background the way the pressure monitor would do it */
+	flat_combining_pool<object> fc_pool;
+	std::vector<std::thread> threads;
+	for(int t = 0; t < 4; t++)
+	{
+		threads.emplace_back([&fc_pool]()
 		{
-			auto next = s->next;
-			purge_segment(s);
-			s = next;
-		}
+			std::vector<object *> objs;
+			for(int i = 0; i < 1000; i++)
+				objs.push_back(fc_pool.allocate());
+			for(auto o : objs)
+				fc_pool.free(o);
+		});
 	}
-};
-
-class object
-{
-private:
-	unsigned long a;
-	unsigned long b;
-	unsigned long c;
-};
-
-#include <vector>
+	threads.emplace_back([]()
+	{
+		for(int i = 0; i < 100; i++)
+			pool_registry::instance().reclaim();
+	});
 
-int main(int argc, char **)
-{
-	memory_pool<object> pool;
-	/* TODO: Why is pool going out of scope */
-	/* TODO: Add support for buffers bigger than 2 * PAGE_SIZE and adjust segment size dynamically */
-	std::vector<object *> vec;
+	for(auto &t : threads)
+		t.join();
+	assert(fc_pool.used_objects() == 0);
 
-	for(int i = 0; i < 10000; i++)
+	/* Threads give their slots back when they exit, including slots in pools
+	 * that fell out of their cache, and skip the pools that are gone by then */
+	for(int t = 0; t < 2 * 64; t++)
 	{
-		auto p = pool.allocate();
-		vec.push_back(p);
-		//std::cout << "Allocated " << p << "\n";
+		std::thread{[&fc_pool]()
+		{
+			std::vector<flat_combining_pool<object>> short_lived(9);
+			for(int round = 0; round < 2; round++)
+			{
+				for(auto &p : short_lived)
+					p.free(p.allocate());
+			}
+			fc_pool.free(fc_pool.allocate());
+		}}.join();
 	}
+	assert(fc_pool.used_objects() == 0);
 
-	for(auto &p : vec)
+	/* The page map sends frees through the combiner, not straight to the inner pool */
 	{
-		pool.free(p);
-		p = nullptr;
+		auto u = pool_unique_ptr<object>{fc_pool.allocate()};
+		assert(fc_pool.owns(u.get()) && fc_pool.used_objects() == 1);
 	}
-
-	pool.purge();
+	assert(fc_pool.used_objects() == 0);
+
+	/* Batched and background frees. The tree is destroyed by the reclaimer,
+	 * with a queue limit it goes past from the reclaimer thread only. */
+	memory_pool<object> batch_pool;
+	std::vector<object *> batch;
+	for(int i = 0; i < 1000; i++)
+		batch.push_back(batch_pool.allocate());
+	batch_pool.free(batch.data(), batch.size() / 2);
+	for(size_t i = batch.size() / 2; i < batch.size(); i++)
+		batch_pool.free_async(batch[i]);
+	pool_reclaimer::instance().drain();
+	assert(batch_pool.used_objects == 0 && pool_reclaimer::instance().queued() == 0);
+
+	memory_pool<tree_node> tree_pool;
+	tree_pool_ptr = &tree_pool;
+	tree_node::destroyed = 0;
+	pool_reclaimer::instance().set_limit(16 * sizeof(tree_node));
+	tree_pool.destroy_async(build_tree(tree_pool, 12));
+	for(int i = 0; i < 100; i++)
+		tree_pool.destroy_async(build_tree(tree_pool, 2));
+	pool_reclaimer::instance().drain();
+	assert(tree_node::destroyed == (1 << 13) - 1 + 100 * 7);
+	assert(tree_pool.used_objects == 0);
+
+	/* A forked child gets a reclaimer of its own */
+	if(fork() == 0)
+	{
+		tree_pool.destroy_async(build_tree(tree_pool, 4));
+		pool_reclaimer::instance().drain();
+		_exit(tree_pool.used_objects == 0 ? 0 : 1);
+	}
+	wait(&status);
+	assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
 
 	//std::cout << "Used objects: " << pool.used_objects << "\n";
 	return 0;
@@ -0,0 +1,385 @@
+#include "memory_pool.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <string>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+/* Searches the memory_pool tunables for a recorded allocation trace: every
+ * candidate replays the trace in a fresh child process, and the ones that
+ * no other candidate beats on both throughput and peak RSS are the Pareto
+ * front. Their settings can go straight into MEMORY_POOL_CONFIG.
+ *
+ *	trace_search [trace file]
+ *
+ * A trace is text, read from stdin without a file:
+ *	size <bytes>	object size, once before anything else
+ *	a <id>		allocate an object
+ *	f <id>		free the object allocated as id
+ *	i		the program was idle, and purges
+ * ids are any numbers, and can be reused once freed. Traces without idle
+ * points get purged every purge_interval operations.
+ *
+ * The reuse order, like the other compile-time policies, can't be searched
+ * from one binary; build this with the policy macros of each candidate
+ * policy, as make matrix does, and compare their fronts. */
+
+struct trace_op
+{
+	enum : uint8_t { allocate, free, idle } kind;
+	/* Index into the live object table */
+	uint32_t slot;
+};
+
+struct trace
+{
+	size_t object_size = 0;
+	size_t nr_slots = 0;
+	std::vector<trace_op> ops;
+};
+
+struct candidate
+{
+	memory_pool_tunables tunables;
+	std::string config;
+	double ops_per_second = 0;
+	size_t peak_rss = 0;
+	bool failed = false;
+	bool pareto = false;
+};
+
+static constexpr size_t purge_interval = 65536;
+
+/* Turns ids into slots of a dense table, so replaying doesn't hash */
+static bool load_trace(FILE *f, trace &t)
+{
+	std::unordered_map<unsigned long, uint32_t> live;
+	std::vector<uint32_t> free_slots;
+	char line[128];
+	size_t lineno = 0;
+
+	while(std::fgets(line, sizeof(line), f))
+	{
+		unsigned long n;
+		char kind;
+		lineno++;
+
+		if(line[0] == '#' || line[0] == '\n')
+			continue;
+
+		if(std::sscanf(line, "size %lu", &n) == 1)
+		{
+			t.object_size = n;
+			continue;
+		}
+
+		if(std::sscanf(line, " %c", &kind) == 1 && kind == 'i')
+		{
+			t.ops.push_back({trace_op::idle, 0});
+			continue;
+		}
+
+		if(std::sscanf(line, " %c %lu", &kind, &n) != 2 || (kind != 'a' && kind != 'f'))
+		{
+			std::fprintf(stderr, "trace_search: bad trace line %zu: %s", lineno, line);
+			return false;
+		}
+
+		if(kind == 'a')
+		{
+			uint32_t slot;
+			if(!free_slots.empty())
+			{
+				slot = free_slots.back();
+				free_slots.pop_back();
+			}
+			else
+			{
+				slot = t.nr_slots++;
+			}
+
+			if(!live.emplace(n, slot).second)
+			{
+				std::fprintf(stderr, "trace_search: line %zu allocates live object %lu\n", lineno, n);
+				return false;
+			}
+
+			t.ops.push_back({trace_op::allocate, slot});
+		}
+		else
+		{
+			auto it = live.find(n);
+			if(it == live.end())
+			{
+				std::fprintf(stderr, "trace_search: line %zu frees unknown object %lu\n", lineno, n);
+				return false;
+			}
+
+			t.ops.push_back({trace_op::free, it->second});
+			free_slots.push_back(it->second);
+			live.erase(it);
+		}
+	}
+
+	if(!t.object_size)
+	{
+		std::fprintf(stderr, "trace_search: the trace has no object size\n");
+		return false;
+	}
+
+	return true;
+}
+
+/* The tunables to try. Segment sizes of 0 let the pool size them for the type. */
+static std::vector<candidate> candidates()
+{
+	std::vector<candidate> all;
+
+	for(size_t segment_size : {0UL, 64UL << 10, 256UL << 10, 1UL << 20, 2UL << 20})
+	for(size_t empty_segments : {0UL, 1UL, 4UL, 16UL})
+	for(long purge_delay_ms : {0L, 10L})
+	for(bool huge_pages : {false, true})
+	{
+		if(huge_pages && segment_size < (2UL << 20))
+			continue;
+
+		candidate c;
+		c.tunables.segment_size = segment_size;
+		c.tunables.empty_segments = empty_segments;
+		c.tunables.purge_delay = std::chrono::milliseconds{purge_delay_ms};
+		c.tunables.huge_pages = huge_pages;
+
+		char config[128];
+		std::snprintf(config, sizeof(config), "segment_size=%zu,empty_segments=%zu,purge_delay_ms=%ld,huge_pages=%d",
+			      segment_size, empty_segments, purge_delay_ms, huge_pages);
+		c.config = config;
+		all.push_back(c);
+	}
+
+	return all;
+}
+
+static size_t status_kb(const char *key)
+{
+	FILE *f = std::fopen("/proc/self/status", "r");
+	if(!f)
+		return 0;
+
+	char line[128];
+	size_t value = 0, len = std::strlen(key);
+	while(std::fgets(line, sizeof(line), f))
+	{
+		if(!std::strncmp(line, key, len))
+		{
+			value = std::strtoul(line + len, nullptr, 10);
+			break;
+		}
+	}
+
+	std::fclose(f);
+	return value;
+}
+
+/* Resets VmHWM, so that it only covers the replay */
+static void reset_peak_rss()
+{
+	int fd = open("/proc/self/clear_refs", O_WRONLY | O_CLOEXEC);
+	if(fd < 0)
+		return;
+	if(write(fd, "5", 1) != 1)
+		std::perror("trace_search: clear_refs");
+	close(fd);
+}
+
+template <size_t Size>
+struct sized_object
+{
+	unsigned char data[Size];
+};
+
+/* Returns the seconds the replay took, and the peak RSS it added in bytes.
+ * Fails if the pool runs out of memory, which makes the candidate infeasible. */
+template <size_t Size>
+static bool replay(const trace &t, const memory_pool_tunables &tunables, double &seconds, size_t &peak_rss)
+{
+	using T = sized_object<Size>;
+	std::vector<T *> slots(t.nr_slots);
+	bool idle_points = std::any_of(t.ops.begin(), t.ops.end(), [](auto &op) { return op.kind == trace_op::idle; });
+
+	memory_pool<T> pool{tunables};
+	reset_peak_rss();
+	auto base_rss = status_kb("VmRSS:");
+	auto start = std::chrono::steady_clock::now();
+	bool ok = true;
+
+	for(size_t i = 0; ok && i < t.ops.size(); i++)
+	{
+		auto &op = t.ops[i];
+		switch(op.kind)
+		{
+			case trace_op::allocate:
+				slots[op.slot] = pool.allocate();
+				if(!slots[op.slot])
+				{
+					ok = false;
+					break;
+				}
+				/* Touch it like the program would */
+				slots[op.slot]->data[0] = 1;
+				break;
+			case trace_op::free:
+				pool.free(slots[op.slot]);
+				slots[op.slot] = nullptr;
+				break;
+			case trace_op::idle:
+				pool.purge();
+				break;
+		}
+
+		if(!idle_points && i % purge_interval == purge_interval - 1)
+			pool.purge();
+	}
+
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+	seconds = elapsed.count();
+	peak_rss = (status_kb("VmHWM:") - std::min(base_rss, status_kb("VmHWM:"))) * 1024;
+
+	/* Objects the trace never freed */
+	for(auto s : slots)
+	{
+		if(s)
+			pool.free(s);
+	}
+
+	return ok;
+}
+
+/* memory_pool needs the type, so objects are rounded up to one of a few sizes */
+static bool replay_sized(const trace &t, const memory_pool_tunables &tunables, double &seconds, size_t &peak_rss)
+{
+	if(t.object_size <= 16)
+		return replay<16>(t, tunables, seconds, peak_rss);
+	else if(t.object_size <= 32)
+		return replay<32>(t, tunables, seconds, peak_rss);
+	else if(t.object_size <= 64)
+		return replay<64>(t, tunables, seconds, peak_rss);
+	else if(t.object_size <= 128)
+		return replay<128>(t, tunables, seconds, peak_rss);
+	else if(t.object_size <= 256)
+		return replay<256>(t, tunables, seconds, peak_rss);
+	else if(t.object_size <= 1024)
+		return replay<1024>(t, tunables, seconds, peak_rss);
+	else if(t.object_size <= 4096)
+		return replay<4096>(t, tunables, seconds, peak_rss);
+
+	return false;
+}
+
+/* Replays in a child, so that every candidate starts from the same RSS */
+static void evaluate(const trace &t, candidate &c)
+{
+	struct
+	{
+		double seconds;
+		size_t peak_rss;
+	} result;
+	int fds[2];
+
+	c.failed = true;
+	if(pipe(fds) < 0)
+		return;
+
+	std::fflush(stdout);
+	pid_t pid = fork();
+	if(pid == 0)
+	{
+		close(fds[0]);
+		int status = 1;
+		if(replay_sized(t, c.tunables, result.seconds, result.peak_rss) &&
+		   write(fds[1], &result, sizeof(result)) == sizeof(result))
+			status = 0;
+		_exit(status);
+	}
+
+	close(fds[1]);
+	if(pid > 0)
+	{
+		int status;
+		bool ok = read(fds[0], &result, sizeof(result)) == sizeof(result);
+		ok &= waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+
+		if(ok)
+		{
+			c.failed = false;
+			c.ops_per_second = t.ops.size() / result.seconds;
+			c.peak_rss = result.peak_rss;
+		}
+	}
+
+	close(fds[0]);
+}
+
+static void mark_pareto_front(std::vector<candidate> &all)
+{
+	for(auto &c : all)
+	{
+		if(c.failed)
+			continue;
+
+		c.pareto = std::none_of(all.begin(), all.end(), [&](const candidate &o) {
+			return !o.failed && o.ops_per_second >= c.ops_per_second && o.peak_rss <= c.peak_rss &&
+			       (o.ops_per_second > c.ops_per_second || o.peak_rss < c.peak_rss);
+		});
+	}
+}
+
+int main(int argc, char **argv)
+{
+	FILE *f = argc > 1 ? std::fopen(argv[1], "r") : stdin;
+	trace t;
+
+	if(!f)
+	{
+		std::perror(argv[1]);
+		return 1;
+	}
+
+	bool loaded = load_trace(f, t);
+	if(f != stdin)
+		std::fclose(f);
+	if(!loaded)
+		return 1;
+
+	if(t.object_size > 4096)
+	{
+		std::fprintf(stderr, "trace_search: objects of %zu bytes are too big\n", t.object_size);
+		return 1;
+	}
+
+	auto all = candidates();
+	for(auto &c : all)
+		evaluate(t, c);
+	mark_pareto_front(all);
+
+	std::sort(all.begin(), all.end(), [](auto &a, auto &b) { return a.peak_rss < b.peak_rss; });
+
+	std::printf("%zu operations, %zu-byte objects, %zu candidates\n", t.ops.size(), t.object_size, all.size());
+	std::printf("%-8s %12s %14s  %s\n", "pareto", "Mops/s", "peak RSS KiB", "config");
+	for(auto &c : all)
+	{
+		if(c.failed)
+			std::printf("%-8s %12s %14s  %s\n", "", "failed", "", c.config.c_str());
+		else
+			std::printf("%-8s %12.2f %14zu  %s\n", c.pareto ? "*" : "", c.ops_per_second / 1e6,
+				    c.peak_rss / 1024, c.config.c_str());
+	}
+
+	return 0;
+}